@@ -20,13 +20,17 @@
  */
 
 #include <glib.h>
+#include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/file.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 
 #include "settings.h"
 #include "utils.h"
+#include "logprint.h"
 
 typedef struct {
   char *category;
@@ -85,12 +89,15 @@ void caps_init(void)
                                        g_free, caps_destroy);
 }
 
+static void caps_store_close(void);
+
 void caps_free(void)
 {
   if (caps_cache) {
     g_hash_table_destroy(caps_cache);
     caps_cache = NULL;
   }
+  caps_store_close();
 }
 
 void caps_add(const char *hash)
@@ -417,39 +424,385 @@ gboolean caps_verify(const char *hash, char *function)
   return match;
 }
 
-static gchar* caps_get_filename(const char* hash)
+/* ### Persistent storage ### */
+
+// Verified capabilities are stored in a single file, "caps.db" in the
+// caps_directory.  Records are only appended; each one is a header line
+// "@caps <hash> <length>" followed by <length> bytes of GKeyFile data and
+// a newline.  When a hash is stored more than once, the last record wins.
+// The index of the records is read once, so that looking for a hash
+// which is not stored costs no file access at all.
+// Several mcabber instances may share the caps_directory: the file is
+// locked (flock) while it is modified, and reopened when another instance
+// has replaced it (compaction).  The records it has appended are indexed
+// the next time the file is locked.
+
+#define CAPS_STORE_FILENAME "caps.db"
+
+typedef struct {
+  off_t offset;     // Position of the data
+  gsize length;
+} caps_record;
+
+static struct {
+  gchar *dir;         // caps_directory the index was loaded from
+  gchar *file;
+  int fd;
+  GHashTable *index;  // hash -> caps_record
+  off_t end;          // Size of the indexed part of the file
+  guint dead;         // Records superseded by a later one
+} caps_store = { NULL, NULL, -1, NULL, 0, 0 };
+
+static void caps_store_close(void)
+{
+  if (caps_store.fd != -1)
+    close(caps_store.fd);
+  caps_store.fd = -1;
+  if (caps_store.index)
+    g_hash_table_destroy(caps_store.index);
+  caps_store.index = NULL;
+  g_free(caps_store.dir);
+  g_free(caps_store.file);
+  caps_store.dir = caps_store.file = NULL;
+  caps_store.end = 0;
+  caps_store.dead = 0;
+}
+
+//  caps_store_load_index()
+// Read the record headers of the store file which are not indexed yet.
+// The file is truncated after the last valid record, so that a partial
+// write is overwritten by the next record.  The file must be locked.
+static void caps_store_load_index(void)
 {
-  gchar *hash_fs;
-  gchar *dir = (gchar *) settings_opt_get ("caps_directory");
-  gchar *file = NULL;
+  FILE *fp;
+  char line[256];
+  off_t end = caps_store.end;
+  struct stat buf;
+  int fd;
 
-  if (!dir)
-    goto caps_filename_return;
+  if (fstat(caps_store.fd, &buf) == -1 || buf.st_size <= end)
+    return;
+
+  fd = dup(caps_store.fd);
+  fp = (fd == -1) ? NULL : fdopen(fd, "r");
+  if (!fp) {
+    if (fd != -1)
+      close(fd);
+    return;
+  }
+  fseeko(fp, end, SEEK_SET);
+
+  while (fgets(line, sizeof(line), fp)) {
+    char hash[200];
+    unsigned long length;
+    caps_record *rec;
+    off_t offset = ftello(fp);
+
+    if (sscanf(line, "@caps %199s %lu", hash, &length) != 2 ||
+        fseeko(fp, length, SEEK_CUR) || fgetc(fp) != '\n')
+      break;
+
+    if (g_hash_table_lookup(caps_store.index, hash))
+      caps_store.dead++;
+    rec = g_new(caps_record, 1);
+    rec->offset = offset;
+    rec->length = length;
+    g_hash_table_replace(caps_store.index, g_strdup(hash), rec);
+    end = ftello(fp);
+  }
+  fclose(fp);
+
+  caps_store.end = end;
+  if (buf.st_size > end && ftruncate(caps_store.fd, end) == -1)
+    scr_LogPrint(LPRINT_LOGNORM, "Cannot truncate caps store %s",
+                 caps_store.file);
+}
+
+//  caps_store_lock()
+// Lock the store file.  If another instance has replaced the file, open
+// the new one and index it from the beginning; otherwise only index the
+// records appended since the last time.
+// Return FALSE if the store cannot be used.
+static gboolean caps_store_lock(void)
+{
+  struct stat fbuf, pbuf;
+
+  for (;;) {
+    if (caps_store.fd == -1)
+      return FALSE;
+    while (flock(caps_store.fd, LOCK_EX) == -1) {
+      if (errno != EINTR) {
+        scr_LogPrint(LPRINT_LOGNORM, "Cannot lock caps store %s",
+                     caps_store.file);
+        return FALSE;
+      }
+    }
+    if (fstat(caps_store.fd, &fbuf) == 0 &&
+        stat(caps_store.file, &pbuf) == 0 &&
+        fbuf.st_dev == pbuf.st_dev && fbuf.st_ino == pbuf.st_ino)
+      break;
+
+    // The file has been replaced or removed, start over
+    close(caps_store.fd);
+    caps_store.fd = open(caps_store.file, O_RDWR|O_CREAT|O_APPEND,
+                         S_IRUSR|S_IWUSR);
+    g_hash_table_remove_all(caps_store.index);
+    caps_store.end = 0;
+    caps_store.dead = 0;
+  }
 
-  hash_fs = g_strdup (hash);
+  caps_store_load_index();
+  return TRUE;
+}
+
+static void caps_store_unlock(void)
+{
+  flock(caps_store.fd, LOCK_UN);
+}
+
+static void caps_store_migrate(const char *dir);
+
+//  caps_store_open()
+// Make sure the store matching the caps_directory option is open.
+// Return FALSE if there is no store.
+static gboolean caps_store_open(void)
+{
+  const char *dir = settings_opt_get("caps_directory");
+  gboolean exists;
+
+  if (!dir) {
+    caps_store_close();
+    return FALSE;
+  }
+  if (caps_store.index && !g_strcmp0(dir, caps_store.dir))
+    return (caps_store.fd != -1);
+
+  caps_store_close();
+  caps_store.dir = g_strdup(dir);
+  caps_store.index = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                           g_free, g_free);
   {
-    const gchar *valid_fs =
-        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+=";
-    g_strcanon(hash_fs, valid_fs, '-');
+    gchar *xdir = expand_filename(dir);
+    caps_store.file = g_strdup_printf("%s/%s", xdir, CAPS_STORE_FILENAME);
+    g_free(xdir);
+  }
+
+  exists = g_file_test(caps_store.file, G_FILE_TEST_EXISTS);
+  caps_store.fd = open(caps_store.file, O_RDWR|O_CREAT|O_APPEND,
+                       S_IRUSR|S_IWUSR);
+  if (caps_store.fd == -1) {
+    scr_LogPrint(LPRINT_LOGNORM, "Cannot open caps store %s",
+                 caps_store.file);
+    return FALSE;
   }
 
-  dir = expand_filename (dir);
-  file = g_strdup_printf ("%s/%s.ini", dir, hash_fs);
-  g_free(dir);
-  g_free(hash_fs);
+  if (!caps_store_lock()) {
+    close(caps_store.fd);
+    caps_store.fd = -1;
+    return FALSE;
+  }
+  caps_store_unlock();
 
-caps_filename_return:
-  return file;
+  if (!exists)
+    caps_store_migrate(dir);
+  return TRUE;
 }
 
-/* Store capabilities set in GKeyFile. To be used with verified hashes only */
+//  caps_store_append(hash, data, length)
+// Append a record to the store and index it, unless another instance has
+// already stored this hash.
+static gboolean caps_store_append(const char *hash, const gchar *data,
+                                  gsize length)
+{
+  gchar *header;
+  GString *rec;
+  off_t end;
+  caps_record *r;
+  gboolean ok;
+
+  if (!caps_store_lock())
+    return FALSE;
+  if (g_hash_table_lookup(caps_store.index, hash)) {
+    caps_store_unlock();
+    return TRUE;
+  }
+  end = lseek(caps_store.fd, 0, SEEK_END);
+  if (end == -1) {
+    caps_store_unlock();
+    return FALSE;
+  }
+
+  header = g_strdup_printf("@caps %s %lu\n", hash, (unsigned long)length);
+  rec = g_string_new(header);
+  g_string_append_len(rec, data, length);
+  g_string_append_c(rec, '\n');
+  ok = (write(caps_store.fd, rec->str, rec->len) == (ssize_t)rec->len);
+
+  if (ok) {
+    r = g_new(caps_record, 1);
+    r->offset = end + strlen(header);
+    r->length = length;
+    g_hash_table_replace(caps_store.index, g_strdup(hash), r);
+    caps_store.end = end + rec->len;
+  } else {
+    scr_LogPrint(LPRINT_LOGNORM, "Cannot write to caps store %s",
+                 caps_store.file);
+  }
+  caps_store_unlock();
+  g_string_free(rec, TRUE);
+  g_free(header);
+  return ok;
+}
+
+//  caps_store_read(hash)
+// Return the GKeyFile data stored for hash, or NULL.
+// The string should be freed by the caller.
+static gchar *caps_store_read(const char *hash)
+{
+  caps_record *rec = g_hash_table_lookup(caps_store.index, hash);
+  gchar *data;
+
+  if (!rec)
+    return NULL;
+
+  data = g_new(gchar, rec->length + 1);
+  if (pread(caps_store.fd, data, rec->length, rec->offset) !=
+      (ssize_t)rec->length) {
+    g_free(data);
+    return NULL;
+  }
+  data[rec->length] = '\0';
+  return data;
+}
+
+//  caps_store_migrate(dir)
+// Import the capabilities stored by older versions, one <hash>.ini file
+// per hash in dir.  The old files are left untouched.
+static void caps_store_migrate(const char *dir)
+{
+  gchar *xdir = expand_filename(dir);
+  GDir *gdir = g_dir_open(xdir, 0, NULL);
+  const gchar *name;
+  guint count = 0;
+
+  if (!gdir) {
+    g_free(xdir);
+    return;
+  }
+
+  while ((name = g_dir_read_name(gdir)) != NULL) {
+    gchar *path, *data, *hash;
+    gsize length;
+
+    if (!g_str_has_suffix(name, ".ini"))
+      continue;
+    path = g_strdup_printf("%s/%s", xdir, name);
+    if (g_file_get_contents(path, &data, &length, NULL)) {
+      // The file name is the hash, with '/' replaced by '-' (which is not
+      // a base64 character).
+      hash = g_strndup(name, strlen(name) - 4);
+      g_strdelimit(hash, "-", '/');
+      if (caps_store_append(hash, data, length))
+        count++;
+      g_free(hash);
+      g_free(data);
+    }
+    g_free(path);
+  }
+  g_dir_close(gdir);
+  g_free(xdir);
+
+  if (count)
+    scr_LogPrint(LPRINT_LOGNORM, "Imported %u capabilities sets into %s",
+                 count, caps_store.file);
+}
+
+//  caps_store_compact()
+// Rewrite the store file without the superseded records.
+void caps_store_compact(void)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+  gchar *tmpfile;
+  GString *out;
+  guint count = 0, dead;
+  gboolean ok;
+
+  if (!caps_store_open()) {
+    scr_LogPrint(LPRINT_NORMAL, "No caps store (caps_directory is not set).");
+    return;
+  }
+  // Other instances must not append to the file while it is rewritten
+  if (!caps_store_lock()) {
+    scr_LogPrint(LPRINT_NORMAL, "Cannot compact caps store %s",
+                 caps_store.file);
+    return;
+  }
+
+  out = g_string_new(NULL);
+  g_hash_table_iter_init(&iter, caps_store.index);
+  while (g_hash_table_iter_next(&iter, &key, &value)) {
+    gchar *data = caps_store_read(key);
+    if (!data)
+      continue;
+    g_string_append_printf(out, "@caps %s %lu\n", (gchar*)key,
+                           (unsigned long)((caps_record*)value)->length);
+    g_string_append_len(out, data, ((caps_record*)value)->length);
+    g_string_append_c(out, '\n');
+    g_free(data);
+    count++;
+  }
+
+  tmpfile = g_strdup_printf("%s.new", caps_store.file);
+  ok = g_file_set_contents(tmpfile, out->str, out->len, NULL);
+  if (ok) {
+    chmod(tmpfile, S_IRUSR|S_IWUSR);
+    ok = (rename(tmpfile, caps_store.file) == 0);
+  }
+  // The instances waiting for the lock will see that the file has changed
+  caps_store_unlock();
+  g_string_free(out, TRUE);
+  g_free(tmpfile);
+
+  if (!ok) {
+    scr_LogPrint(LPRINT_NORMAL, "Cannot compact caps store %s",
+                 caps_store.file);
+    return;
+  }
+
+  dead = caps_store.dead;
+  // Reload the index
+  g_free(caps_store.dir);
+  caps_store.dir = NULL;
+  caps_store_open();
+  scr_LogPrint(LPRINT_NORMAL, "Caps store compacted: %u entries, "
+               "%u obsolete records removed.", count, dead);
+}
+
+//  caps_store_info()
+// Display some information about the caps store.
+void caps_store_info(void)
+{
+  struct stat buf;
+
+  if (!caps_store_open()) {
+    scr_LogPrint(LPRINT_NORMAL, "No caps store (caps_directory is not set).");
+    return;
+  }
+  if (fstat(caps_store.fd, &buf) == -1)
+    buf.st_size = 0;
+  scr_LogPrint(LPRINT_NORMAL, "Caps store %s: %u entries, "
+               "%u obsolete records, %lu bytes.", caps_store.file,
+               g_hash_table_size(caps_store.index), caps_store.dead,
+               (unsigned long)buf.st_size);
+}
+
+/* Store capabilities set in the caps store. To be used with verified hashes only */
 void caps_copy_to_persistent(const char* hash, char* xml)
 {
-  gchar *file;
   GList *features, *langs, *forms;
   GKeyFile *key_file;
   caps *c;
-  int fd;
 
   g_free (xml);
 
@@ -457,13 +810,11 @@ void caps_copy_to_persistent(const char* hash, char* xml)
   if (!c)
     goto caps_copy_return;
 
-  file = caps_get_filename (hash);
-  if (!file)
+  if (!caps_store_open())
     goto caps_copy_return;
 
-  fd = open (file, O_WRONLY|O_CREAT|O_EXCL, S_IRUSR|S_IWUSR);
-  if (fd == -1)
-    goto caps_copy_exists;
+  if (g_hash_table_lookup(caps_store.index, hash))
+    goto caps_copy_return;
 
   key_file = g_key_file_new ();
   g_key_file_set_comment (key_file, NULL, NULL,
@@ -551,32 +902,29 @@ void caps_copy_to_persistent(const char* hash, char* xml)
     gchar *data;
     gsize length;
     data = g_key_file_to_data (key_file, &length, NULL);
-    write (fd, data, length);
+    caps_store_append(hash, data, length);
     g_free(data);
-    close (fd);
   }
 
   g_key_file_free(key_file);
-caps_copy_exists:
-  g_free(file);
 caps_copy_return:
   return;
 }
 
-/* Restore capabilities from GKeyFile. Hash is not verified afterwards */
+/* Restore capabilities from the caps store. Hash is not verified afterwards */
 gboolean caps_restore_from_persistent (const char* hash)
 {
-  gchar *file;
+  gchar *data;
   GKeyFile *key_file;
   gchar **groups, **group;
   gboolean restored = FALSE;
 
-  file = caps_get_filename (hash);
-  if (!file)
+  // Unknown hashes are not in the index: no file access for them
+  if (!caps_store_open() || !(data = caps_store_read(hash)))
     goto caps_restore_no_file;
 
   key_file = g_key_file_new ();
-  if (!g_key_file_load_from_file (key_file, file, G_KEY_FILE_NONE, NULL))
+  if (!g_key_file_load_from_data (key_file, data, -1, G_KEY_FILE_NONE, NULL))
     goto caps_restore_bad_file;
 
   caps_add(hash);
@@ -628,7 +976,7 @@ gboolean caps_restore_from_persistent (const char* hash)
 
 caps_restore_bad_file:
   g_key_file_free (key_file);
-  g_free (file);
+  g_free (data);
 caps_restore_no_file:
   return restored;
 }
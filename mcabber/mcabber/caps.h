@@ -29,6 +29,8 @@ char *caps_generate(void);
 gboolean caps_verify(const char *hash, char *function);
 void  caps_copy_to_persistent(const char *hash, char *xml);
 gboolean caps_restore_from_persistent(const char *hash);
+void  caps_store_compact(void);
+void  caps_store_info(void);
 
 #endif /* __MCABBER_CAPS_H__ */
 
@@ -25,6 +25,7 @@
 #include "xmpp_defines.h"
 #include "logprint.h"
 #include "xmpp.h"
+#include "sendq.h"
 
 static int _carbons_available = 0;
 static int _carbons_enabled = 0;
@@ -75,7 +76,7 @@ void carbons_enable()
   lm_message_node_set_attribute(enable, "xmlns", NS_CARBONS_2);
   handler = lm_message_handler_new(cb_carbons, NULL, NULL);
 
-  if (!lm_connection_send_with_reply(lconnection, iq, handler, &error)) {
+  if (!sendq_send_with_reply(iq, handler, &error)) {
     scr_log_print(LPRINT_DEBUG, "Error sending IQ request: %s.",
                   error->message);
     g_error_free(error);
@@ -116,7 +117,7 @@ void carbons_disable()
   lm_message_node_set_attribute(disable, "xmlns", NS_CARBONS_2);
   handler = lm_message_handler_new(cb_carbons, NULL, NULL);
 
-  if (!lm_connection_send_with_reply(lconnection, iq, handler, &error)) {
+  if (!sendq_send_with_reply(iq, handler, &error)) {
     scr_log_print(LPRINT_DEBUG, "Error sending IQ request: %s.",
                   error->message);
     g_error_free(error);
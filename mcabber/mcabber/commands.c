@@ -40,6 +40,9 @@
 #include "events.h"
 #include "otr.h"
 #include "carbons.h"
+#include "caps.h"
+#include "csi.h"
+#include "sendq.h"
 #include "utf8.h"
 #include "xmpp.h"
 #include "main.h"
@@ -94,6 +97,8 @@ static void do_otrpolicy(char *arg);
 static void do_echo(char *arg);
 static void do_module(char *arg);
 static void do_carbons(char *arg);
+static void do_caps(char *arg);
+static void do_csi(char *arg);
 
 static void room_bookmark(gpointer bud, char *arg);
 
@@ -190,8 +195,12 @@ void cmd_init(void)
   cmd_add("bind", "Add an key binding", 0, 0, &do_bind, NULL);
   cmd_add("buffer", "Manipulate current buddy's buffer (chat window)",
           COMPL_BUFFER, 0, &do_buffer, NULL);
+  cmd_add("caps", "Manage the entity capabilities store", COMPL_CAPS, 0,
+          &do_caps, NULL);
   cmd_add("carbons", "Manage carbons settings", COMPL_CARBONS, 0,
           &do_carbons, NULL);
+  cmd_add("csi", "Manage the client state indication", COMPL_CSI, 0,
+          &do_csi, NULL);
   cmd_add("chat_disable", "Disable chat mode", 0, 0, &do_chat_disable, NULL);
   cmd_add("clear", "Clear the dialog window", 0, 0, &do_clear, NULL);
   cmd_add("color", "Set coloring options", COMPL_COLOR, 0, &do_color, NULL);
@@ -397,6 +406,16 @@ void cmd_init(void)
   compl_add_category_word(COMPL_CARBONS, "info");
   compl_add_category_word(COMPL_CARBONS, "enable");
   compl_add_category_word(COMPL_CARBONS, "disable");
+
+  // Caps category
+  compl_add_category_word(COMPL_CAPS, "info");
+  compl_add_category_word(COMPL_CAPS, "compact");
+
+  // CSI category
+  compl_add_category_word(COMPL_CSI, "info");
+  compl_add_category_word(COMPL_CSI, "auto");
+  compl_add_category_word(COMPL_CSI, "active");
+  compl_add_category_word(COMPL_CSI, "inactive");
 }
 
 //  expandalias(line)
@@ -2525,7 +2544,7 @@ static void do_rawxml(char *arg)
     buffer = to_utf8(arg);
     if (buffer) {
       scr_LogPrint(LPRINT_NORMAL, "Sending XML string");
-      lm_connection_send_raw(lconnection, buffer, NULL);
+      sendq_send_raw(buffer);
       g_free(buffer);
     } else {
       scr_LogPrint(LPRINT_NORMAL, "Conversion error in XML string.");
@@ -4195,11 +4214,14 @@ static void do_source(char *arg)
 
 static void do_connect(char *arg)
 {
+  // Connect right now, and forget about the previous failures
+  xmpp_reconnect_cancel();
   xmpp_connect();
 }
 
 static void do_disconnect(char *arg)
 {
+  xmpp_reconnect_cancel();
   xmpp_disconnect();
 }
 
@@ -4227,4 +4249,30 @@ static void do_carbons(char *arg)
   }
 }
 
+static void do_caps(char *arg)
+{
+  if (!strcasecmp(arg, "info") || !*arg) {
+    caps_store_info();
+  } else if (!strcasecmp(arg, "compact")) {
+    caps_store_compact();
+  } else {
+    scr_log_print(LPRINT_NORMAL, "Unrecognized parameter!");
+  }
+}
+
+static void do_csi(char *arg)
+{
+  if (!strcasecmp(arg, "info") || !*arg) {
+    csi_info();
+  } else if (!strcasecmp(arg, "auto")) {
+    csi_set_mode(csi_auto);
+  } else if (!strcasecmp(arg, "active")) {
+    csi_set_mode(csi_active);
+  } else if (!strcasecmp(arg, "inactive")) {
+    csi_set_mode(csi_inactive);
+  } else {
+    scr_log_print(LPRINT_NORMAL, "Unrecognized parameter!");
+  }
+}
+
 /* vim: set expandtab cindent cinoptions=>2\:2(0 sw=2 ts=2:  For Vim users... */
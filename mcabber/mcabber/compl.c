@@ -59,6 +59,7 @@ typedef struct {
 #define COMPL_CAT_BUILTIN   0x01
 #define COMPL_CAT_ACTIVE    0x02
 #define COMPL_CAT_DYNAMIC   0x04
+#define COMPL_CAT_SHARED    0x08  // The dynamic list must not be freed
 #define COMPL_CAT_REVERSE   0x10
 #define COMPL_CAT_NOSORT    0x20
 
@@ -69,14 +70,15 @@ static category *Categories;
 static guint num_categories;
 
 // Dynamic completions callbacks
+// (These two lists are owned by the roster)
 static GSList *compl_dyn_group (void)
 {
-  return compl_list(ROSTER_TYPE_GROUP);
+  return compl_list_cached(ROSTER_TYPE_GROUP);
 }
 
 static GSList *compl_dyn_user (void)
 {
-  return compl_list(ROSTER_TYPE_USER);
+  return compl_list_cached(ROSTER_TYPE_USER);
 }
 
 static GSList *compl_dyn_resource (void)
@@ -135,6 +137,11 @@ void compl_init_system(void)
   register_builtin_cat(COMPL_OTRPOLICY, NULL);
   register_builtin_cat(COMPL_MODULE, NULL);
   register_builtin_cat(COMPL_CARBONS, NULL);
+  register_builtin_cat(COMPL_CAPS, NULL);
+  register_builtin_cat(COMPL_CSI, NULL);
+
+  Categories[COMPL_JID-1].flags       |= COMPL_CAT_SHARED;
+  Categories[COMPL_GROUPNAME-1].flags |= COMPL_CAT_SHARED;
 }
 
 #ifdef MODULES_ENABLE
@@ -442,7 +449,7 @@ GSList *compl_get_category_list(guint categ, guint *dynlist)
   }
 
   if (Categories[categ].flags & COMPL_CAT_DYNAMIC) {
-    *dynlist = TRUE;
+    *dynlist = !(Categories[categ].flags & COMPL_CAT_SHARED);
     return (*Categories[categ].dynamic) ();
   } else {
     *dynlist = FALSE;
@@ -28,8 +28,10 @@
 #define COMPL_OTRPOLICY   21
 #define COMPL_MODULE      22
 #define COMPL_CARBONS     23
+#define COMPL_CAPS        24
+#define COMPL_CSI         25
 /* private */
-#define COMPL_MAX_ID      23
+#define COMPL_MAX_ID      25
 
 void compl_init_system(void); /* private */
 
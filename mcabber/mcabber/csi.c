@@ -0,0 +1,235 @@
+/*
+ * csi.c        -- Client State Indication (XEP-0352)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <time.h>
+
+#include "csi.h"
+#include "settings.h"
+#include "xmpp_helper.h"
+#include "xmpp_defines.h"
+#include "logprint.h"
+#include "xmpp.h"
+#include "sendq.h"
+
+static struct {
+  enum csi_mode mode;   // Manual override (/csi active|inactive)
+  gboolean supported;   // Advertised in the stream features
+  gboolean idle;        // No recent user activity
+  gboolean sent;        // TRUE if the server thinks we're inactive
+  time_t last_activity;
+  guint idle_source;
+  // Statistics
+  time_t since;         // Start of the current (active/inactive) period
+  gulong time[2];       // Seconds spent active, inactive
+  gulong stanzas[2];    // Stanzas received while active, inactive
+  guint switches;
+} csi = { csi_auto, FALSE, FALSE, FALSE, 0, 0, 0, {0, 0}, {0, 0}, 0 };
+
+static gboolean csi_wanted_inactive(void)
+{
+  if (csi.mode == csi_auto)
+    return csi.idle;
+  return (csi.mode == csi_inactive);
+}
+
+static void csi_account(void)
+{
+  time_t now = time(NULL);
+
+  if (csi.since && now > csi.since)
+    csi.time[csi.sent] += now - csi.since;
+  csi.since = now;
+}
+
+//  csi_update()
+// Tell the server about our state, if it has changed.
+static void csi_update(void)
+{
+  gboolean inactive = csi_wanted_inactive();
+
+  if (inactive == csi.sent)
+    return;
+  if (!settings_opt_get_int("csi") || !csi.supported ||
+      !lconnection || !xmpp_is_online())
+    return;
+
+  csi_account();
+  if (inactive)
+    sendq_send_raw("<inactive xmlns='" NS_CSI "'/>");
+  else
+    sendq_send_raw("<active xmlns='" NS_CSI "'/>");
+  csi.sent = inactive;
+  csi.switches++;
+  scr_log_print(LPRINT_DEBUG, "CSI: %s.", inactive ? "inactive" : "active");
+}
+
+static gboolean csi_idle_timeout(gpointer data)
+{
+  int delay = settings_opt_get_int("csi_idle");
+  time_t now = time(NULL);
+
+  csi.idle_source = 0;
+  if (delay <= 0)
+    return FALSE;
+  if (now - csi.last_activity < delay) {
+    // There has been some activity since the timeout was set up
+    csi.idle_source = g_timeout_add_seconds(delay -
+                                            (now - csi.last_activity),
+                                            csi_idle_timeout, NULL);
+    return FALSE;
+  }
+  csi.idle = TRUE;
+  csi_update();
+  return FALSE;
+}
+
+static void csi_arm_idle_timer(void)
+{
+  int delay = settings_opt_get_int("csi_idle");
+
+  if (delay > 0 && !csi.idle_source)
+    csi.idle_source = g_timeout_add_seconds(delay, csi_idle_timeout, NULL);
+}
+
+//  csi_activity()
+// Called on keyboard activity.
+void csi_activity(void)
+{
+  csi.last_activity = time(NULL);
+  if (csi.idle) {
+    csi.idle = FALSE;
+    csi_update();
+  }
+  csi_arm_idle_timer();
+}
+
+//  csi_set_idle(idle)
+// Called when the auto-away status is set or reset.
+void csi_set_idle(gboolean idle)
+{
+  csi.idle = idle;
+  csi_update();
+}
+
+//  csi_set_mode(mode)
+// Force the client state, or let mcabber choose it (csi_auto).
+void csi_set_mode(enum csi_mode mode)
+{
+  csi.mode = mode;
+  if (!settings_opt_get_int("csi"))
+    scr_log_print(LPRINT_NORMAL, "Note: the 'csi' option is not set.");
+  csi_update();
+}
+
+//  csi_connected()
+// A new stream starts in the active state.
+void csi_connected(void)
+{
+  csi_account();
+  csi.sent = FALSE;
+  if (settings_opt_get_int("csi") && !csi.supported)
+    scr_log_print(LPRINT_LOGNORM, "The server does not support CSI.");
+  // We may never see a key press (e.g. in a detached terminal)
+  if (!csi.last_activity)
+    csi.last_activity = time(NULL);
+  csi_arm_idle_timer();
+  csi_update();
+}
+
+//  csi_reset()
+// The connection has been closed.
+void csi_reset(void)
+{
+  csi_account();
+  csi.sent = FALSE;
+  csi.supported = FALSE;
+  csi.since = 0;
+}
+
+static LmHandlerResult csi_count_cb(LmMessageHandler *h, LmConnection *c,
+                                    LmMessage *m, gpointer user_data)
+{
+  csi.stanzas[csi.sent]++;
+  return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
+}
+
+static LmHandlerResult csi_features_cb(LmMessageHandler *h, LmConnection *c,
+                                       LmMessage *m, gpointer user_data)
+{
+  LmMessageNode *node;
+
+  // The features are sent again after each stream restart, the last ones
+  // are those of the authenticated stream.
+  csi.supported = FALSE;
+  for (node = m->node->children; node; node = node->next)
+    if (!g_strcmp0(node->name, "csi") &&
+        !g_strcmp0(lm_message_node_get_attribute(node, "xmlns"), NS_CSI))
+      csi.supported = TRUE;
+  return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
+}
+
+//  csi_register_handlers(connection)
+// Look for CSI in the stream features, and count the stanzas received in
+// each state.
+void csi_register_handlers(LmConnection *connection)
+{
+  LmMessageHandler *handler;
+  LmMessageType types[] = {
+    LM_MESSAGE_TYPE_MESSAGE, LM_MESSAGE_TYPE_PRESENCE, LM_MESSAGE_TYPE_IQ
+  };
+  guint i;
+
+  handler = lm_message_handler_new(csi_count_cb, NULL, NULL);
+  for (i = 0; i < G_N_ELEMENTS(types); i++)
+    lm_connection_register_message_handler(connection, handler, types[i],
+                                           LM_HANDLER_PRIORITY_FIRST);
+  lm_message_handler_unref(handler);
+
+  handler = lm_message_handler_new(csi_features_cb, NULL, NULL);
+  lm_connection_register_message_handler(connection, handler,
+                                         LM_MESSAGE_TYPE_STREAM_FEATURES,
+                                         LM_HANDLER_PRIORITY_FIRST);
+  lm_message_handler_unref(handler);
+}
+
+void csi_info(void)
+{
+  gulong avoided = 0;
+
+  csi_account();
+  scr_log_print(LPRINT_NORMAL, "Client state: %s (%s)%s.",
+                csi.sent ? "inactive" : "active",
+                csi.mode == csi_auto ? "auto" : "forced",
+                !settings_opt_get_int("csi") ? ", CSI disabled" :
+                csi.supported ? "" : ", not supported by the server");
+  scr_log_print(LPRINT_NORMAL, "Active: %lu stanzas received in %lu s.",
+                csi.stanzas[0], csi.time[0]);
+  scr_log_print(LPRINT_NORMAL, "Inactive: %lu stanzas received in %lu s.",
+                csi.stanzas[1], csi.time[1]);
+  // Estimate what we would have received at the "active" rate
+  if (csi.time[0] && csi.time[1]) {
+    gdouble expected = (gdouble)csi.stanzas[0] * csi.time[1] / csi.time[0];
+    if (expected > csi.stanzas[1])
+      avoided = (gulong)(expected - csi.stanzas[1]);
+  }
+  scr_log_print(LPRINT_NORMAL, "State changes: %u, stanzas avoided "
+                "(estimate): %lu.", csi.switches, avoided);
+}
+
+/* vim: set expandtab cindent cinoptions=>2\:2(0 sw=2 ts=2:  For Vim users... */
@@ -0,0 +1,23 @@
+#ifndef __MCABBER_CSI_H__
+#define __MCABBER_CSI_H__ 1
+
+#include <glib.h>
+#include <loudmouth/loudmouth.h>
+
+enum csi_mode {
+  csi_auto,
+  csi_active,
+  csi_inactive
+};
+
+void csi_activity(void);
+void csi_set_idle(gboolean idle);
+void csi_set_mode(enum csi_mode mode);
+void csi_connected(void);
+void csi_reset(void);
+void csi_register_handlers(LmConnection *connection);
+void csi_info(void);
+
+#endif /* __MCABBER_CSI_H__ */
+
+/* vim: set expandtab cindent cinoptions=>2\:2(0 sw=2 ts=2:  For Vim users... */
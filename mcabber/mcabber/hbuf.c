@@ -43,6 +43,9 @@ typedef struct {
   struct { // hbuf_line_info
     time_t timestamp;
     unsigned mucnicklen;
+    guint  mucnickhash;
+    gchar *rendered;      // Formatted prefix (see hbuf_set_prefix_memo())
+    guchar renderedtimelen;
     guint  flags;
     gpointer xep184;
   } prefix;
@@ -143,6 +146,13 @@ void hbuf_add_line(GList **p_hbuf, const char *text, time_t timestamp,
   hbuf_block_elt->prefix.flags      = prefix_flags;
   hbuf_block_elt->prefix.mucnicklen = mucnicklen;
   hbuf_block_elt->prefix.xep184     = xep184;
+  // The nick is decorated ("<nick>" or "*nick "), the hash is computed
+  // on the nick itself so that both forms get the same color.
+  if (mucnicklen > 2 && mucnicklen <= textlen) {
+    const guchar *p;
+    for (p = (const guchar*)text+1; p < (const guchar*)text+mucnicklen-1; p++)
+      hbuf_block_elt->prefix.mucnickhash += *p;
+  }
   if (!*p_hbuf) {
     hbuf_block_elt->ptr  = g_new(char, hbb_blocksize);
     if (!hbuf_block_elt->ptr) {
@@ -208,6 +218,7 @@ void hbuf_add_line(GList **p_hbuf, const char *text, time_t timestamp,
                 g_free(hbuf_b_elt->ptr);
               }
             }
+            g_free(hbuf_b_elt->prefix.rendered);
             g_free(hbuf_b_elt);
             hbuf_head = *p_hbuf = g_list_delete_link(hbuf_head, hbuf_elt);
           }
@@ -245,6 +256,7 @@ void hbuf_free(GList **p_hbuf)
     if (hbuf_b_elt->flags & HBB_FLAG_ALLOC) {
       g_free(hbuf_b_elt->ptr);
     }
+    g_free(hbuf_b_elt->prefix.rendered);
     g_free(hbuf_b_elt);
   }
 
@@ -275,6 +287,7 @@ void hbuf_rebuild(GList **p_hbuf, unsigned int width)
     // Is next line not-persistent?
     if (!(hbuf_b_next->flags & HBB_FLAG_PERSISTENT)) {
       hbuf_b_curr->ptr_end = hbuf_b_next->ptr_end;
+      g_free(hbuf_b_next->prefix.rendered);
       g_free(hbuf_b_next);
       curr_elt = g_list_delete_link(curr_elt, next_elt);
     } else
@@ -353,6 +366,7 @@ hbb_line **hbuf_get_lines(GList *hbuf, unsigned int n)
       (*array_elt)->timestamp  = blk->prefix.timestamp;
       (*array_elt)->flags      = blk->prefix.flags;
       (*array_elt)->mucnicklen = blk->prefix.mucnicklen;
+      (*array_elt)->mucnickhash = blk->prefix.mucnickhash;
       (*array_elt)->text       = g_strndup(blk->ptr, maxlen);
 
       if ((blk->flags & HBB_FLAG_PERSISTENT) &&
@@ -537,12 +551,54 @@ gboolean hbuf_remove_receipt(GList *hbuf, gconstpointer xep184)
       g_free(blk->prefix.xep184);
       blk->prefix.xep184 = NULL;
       blk->prefix.flags ^= HBB_PREFIX_RECEIPT;
+      // The receipt flag is displayed in the prefix
+      g_free(blk->prefix.rendered);
+      blk->prefix.rendered = NULL;
       return TRUE;
     }
   }
   return FALSE;
 }
 
+//  hbuf_get_prefix_memo(l_line, timelen)
+// Return the formatted prefix saved for this line with
+// hbuf_set_prefix_memo(), or NULL.  If timelen is not NULL, it is set
+// to the length of the time part of the prefix.
+const char *hbuf_get_prefix_memo(GList *l_line, size_t *timelen)
+{
+  hbuf_block *blk = (hbuf_block*)(l_line->data);
+
+  if (blk->prefix.rendered && timelen)
+    *timelen = blk->prefix.renderedtimelen;
+  return blk->prefix.rendered;
+}
+
+//  hbuf_set_prefix_memo(l_line, prefix, timelen)
+// Save the formatted prefix of a line, so that it does not need to be
+// formatted again each time the line is displayed.
+void hbuf_set_prefix_memo(GList *l_line, const char *prefix, size_t timelen)
+{
+  hbuf_block *blk = (hbuf_block*)(l_line->data);
+
+  g_free(blk->prefix.rendered);
+  blk->prefix.rendered = g_strdup(prefix);
+  blk->prefix.renderedtimelen = MIN(timelen, 255);
+}
+
+//  hbuf_clear_prefix_memo(hbuf)
+// Forget all the formatted prefixes of the buffer (e.g. because the
+// prefix format has changed).
+void hbuf_clear_prefix_memo(GList *hbuf)
+{
+  hbuf_block *blk;
+
+  for (hbuf = g_list_first(hbuf); hbuf; hbuf = g_list_next(hbuf)) {
+    blk = (hbuf_block*)(hbuf->data);
+    g_free(blk->prefix.rendered);
+    blk->prefix.rendered = NULL;
+  }
+}
+
 //  hbuf_set_readmark(hbuf, action)
 // Set/Reset the readmark Flag
 // If action is TRUE, set a mark to the latest line,
@@ -37,6 +37,7 @@ typedef struct {
   time_t timestamp;
   guint flags;
   unsigned mucnicklen;
+  guint mucnickhash;  // Hash of the MUC nick, used for automatic nick colors
   char *text;
 } hbb_line;
 
@@ -53,6 +54,9 @@ GList *hbuf_jump_date(GList *hbuf, time_t t);
 GList *hbuf_jump_percent(GList *hbuf, int pc);
 GList *hbuf_jump_readmark(GList *hbuf);
 gboolean hbuf_remove_receipt(GList *hbuf, gconstpointer xep184);
+const char *hbuf_get_prefix_memo(GList *l_line, size_t *timelen);
+void hbuf_set_prefix_memo(GList *l_line, const char *prefix, size_t timelen);
+void hbuf_clear_prefix_memo(GList *hbuf);
 void hbuf_set_readmark(GList *hbuf, gboolean action);
 void hbuf_remove_trailing_readmark(GList *hbuf);
 
@@ -38,6 +38,8 @@
 #include "roster.h"
 #include "xmpp.h"
 
+#define HLOG_TAIL_SIZE  8192  // Bytes read by hlog_read_tail()
+
 static guint UseFileLogging;
 static guint FileLoadLogs;
 static char *RootDir;
@@ -347,14 +349,15 @@ void hlog_read_history(const char *bjid, GList **p_buddyhbuf, guint width)
         if (info == 'I')
           prefix_flags = HBB_PREFIX_INFO;
       }
-      converted = from_utf8(&data[dataoffset+1]);
+      converted = from_utf8_ref(&data[dataoffset+1]);
       if (converted) {
         xtext = ut_expand_tabs(converted); // Expand tabs
         hbuf_add_line(p_buddyhbuf, xtext, timestamp, prefix_flags, width,
                       max_num_of_blocks, 0, NULL);
         if (xtext != converted)
           g_free(xtext);
-        g_free(converted);
+        if (converted != &data[dataoffset+1])
+          g_free(converted);
       }
       err = 0;
     }
@@ -363,6 +366,98 @@ void hlog_read_history(const char *bjid, GList **p_buddyhbuf, guint width)
   g_free(data);
 }
 
+//  hlog_read_tail(bjid, func, data)
+// Call func(timestamp, info, text, data) for each message (sent or
+// received) found at the end of the jid's history logfile.
+// Only the last HLOG_TAIL_SIZE bytes of the file are read.
+void hlog_read_tail(const char *bjid,
+                    void (*func)(time_t, guchar, const char *, gpointer),
+                    gpointer data)
+{
+  char *filename;
+  char *buf, *line, *eol;
+  GString *msg;
+  time_t timestamp;
+  guchar info;
+  guint len;
+  long offset = 0;
+  size_t size;
+  FILE *fp;
+  struct stat bufstat;
+
+  filename = user_histo_file(bjid);
+  if (!filename)
+    return;
+  fp = fopen(filename, "r");
+  g_free(filename);
+  if (!fp)
+    return;
+
+  if (!fstat(fileno(fp), &bufstat) && bufstat.st_size > HLOG_TAIL_SIZE)
+    offset = bufstat.st_size - HLOG_TAIL_SIZE;
+  if (fseek(fp, offset, SEEK_SET)) {
+    fclose(fp);
+    return;
+  }
+  buf = g_new(char, HLOG_TAIL_SIZE+1);
+  size = fread(buf, 1, HLOG_TAIL_SIZE, fp);
+  fclose(fp);
+  buf[size] = '\0';
+
+  line = buf;
+  // The first line is probably incomplete
+  if (offset && (line = strchr(buf, '\n')) != NULL)
+    line++;
+
+  msg = g_string_new(NULL);
+  /* See write_histo_line() for line format... */
+  for ( ; line && *line; line = eol) {
+    eol = strchr(line, '\n');
+    if (eol)
+      *eol++ = '\0';
+    if (strlen(line) < 26 || line[0] != 'M' || line[11] != 'T' ||
+        line[20] != 'Z' || line[21] != ' ' ||
+        (line[25] != ' ' && line[26] != ' '))
+      continue;
+    info = line[1];
+    g_string_assign(msg, line + (line[25] == ' ' ? 26 : 27));
+    line[21] = '\0';
+    timestamp = from_iso8601(&line[3], 1);
+    len = (guint) atoi(&line[22]);
+    // Continuation lines
+    while (len-- && eol && *eol) {
+      line = eol;
+      eol = strchr(line, '\n');
+      if (eol)
+        *eol++ = '\0';
+      g_string_append_c(msg, '\n');
+      g_string_append(msg, line);
+    }
+    if (info == 'S' || info == 'R')
+      func(timestamp, info, msg->str, data);
+  }
+
+  g_string_free(msg, TRUE);
+  g_free(buf);
+}
+
+static void hlog_last_timestamp(time_t timestamp, guchar info,
+                                const char *text, gpointer data)
+{
+  *(time_t *)data = timestamp;
+}
+
+//  hlog_get_last_timestamp(bjid)
+// Return the timestamp of the last message (sent or received) in the jid's
+// history logfile, or 0 if there is none.
+time_t hlog_get_last_timestamp(const char *bjid)
+{
+  time_t last = 0;
+
+  hlog_read_tail(bjid, hlog_last_timestamp, &last);
+  return last;
+}
+
 //  hlog_enable()
 // Enable logging to files.  If root_dir is NULL, then the subdirectory "histo"
 // in mcabber configuration directory is used.
@@ -8,6 +8,10 @@
 void hlog_enable(guint enable, const char *root_dir, guint loadfile);
 char *hlog_get_log_jid(const char *bjid);
 void hlog_read_history(const char *bjid, GList **p_buddyhbuf, guint width);
+void hlog_read_tail(const char *bjid,
+                    void (*func)(time_t, guchar, const char *, gpointer),
+                    gpointer data);
+time_t hlog_get_last_timestamp(const char *bjid);
 void hlog_write_message(const char *bjid, time_t timestamp, int sent,
                         const char *msg);
 void hlog_write_status(const char *bjid, time_t timestamp,
@@ -198,9 +198,15 @@ void hk_message_in(const char *bjid, const char *resname,
   const char *ename = NULL;
   gboolean attention = FALSE, mucprivmsg = FALSE;
   gboolean error_msg_subtype = (type == LM_MESSAGE_SUB_TYPE_ERROR);
+  guint conv_calls, conv_allocs;
 #ifdef MODULES_ENABLE
   gchar strdelay[32];
+#endif
+
+  // Count the locale conversions made for this message (see below)
+  ut_conv_count(&conv_calls, &conv_allocs);
 
+#ifdef MODULES_ENABLE
   if (timestamp)
     to_iso8601(strdelay, timestamp);
   else
@@ -441,6 +447,14 @@ void hk_message_in(const char *bjid, const char *resname,
     update_roster = TRUE;
   }
 
+  if (settings_opt_get_int("tracelog_level") >= 2) {
+    guint calls, allocs;
+    ut_conv_count(&calls, &allocs);
+    scr_LogPrint(LPRINT_DEBUG, "Message from <%s>: %u locale conversions, "
+                 "%u allocated.", bjid, calls - conv_calls,
+                 allocs - conv_allocs);
+  }
+
   g_free(bmsg);
   g_free(mmsg);
 }
@@ -509,6 +523,139 @@ void hk_message_out(const char *bjid, const char *nick,
   g_free(mmsg);
 }
 
+/* Presence batches */
+
+#define DEFAULT_PRESENCE_SUMMARY_THRESHOLD  50
+
+struct room_tally {
+  guint joined;
+  guint left;
+  guint changed;
+};
+
+static struct {
+  gboolean active;
+  gboolean summary;     // Per-presence lines are replaced with a summary
+  guint size;
+  guint coalesced;
+  guint changes;        // Buddy status changes
+  GHashTable *rooms;    // Room JID -> struct room_tally
+} presence_batch;
+
+//  hk_presence_batch_begin(size, coalesced)
+// Start processing a batch of "size" presence packets ("coalesced" packets
+// have been dropped because a later presence superseded them).
+// The roster is rebuilt once, in hk_presence_batch_end().
+void hk_presence_batch_begin(guint size, guint coalesced)
+{
+  const char *p = settings_opt_get("presence_summary_threshold");
+  int threshold = p ? atoi(p) : DEFAULT_PRESENCE_SUMMARY_THRESHOLD;
+
+  presence_batch.active = TRUE;
+  presence_batch.size = size;
+  presence_batch.coalesced = coalesced;
+  presence_batch.changes = 0;
+  presence_batch.summary = (threshold > 0 && size > (guint)threshold);
+
+  if (coalesced)
+    scr_LogPrint(LPRINT_DEBUG, "Presence batch: %u packets (%u coalesced).",
+                 size, coalesced);
+}
+
+//  hk_presence_batch_summary()
+// Return TRUE if the per-presence lines should not be displayed.
+gboolean hk_presence_batch_summary(void)
+{
+  return presence_batch.active && presence_batch.summary;
+}
+
+//  hk_presence_batch_room(roomjid, how)
+// Count a room occupant event (join if how > 0, leave if how < 0, status
+// change otherwise) for the batch summary.
+void hk_presence_batch_room(const char *roomjid, int how)
+{
+  struct room_tally *t;
+
+  if (!presence_batch.rooms)
+    presence_batch.rooms = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                 g_free, g_free);
+  t = g_hash_table_lookup(presence_batch.rooms, roomjid);
+  if (!t) {
+    t = g_new0(struct room_tally, 1);
+    g_hash_table_insert(presence_batch.rooms, g_strdup(roomjid), t);
+  }
+  if (how > 0)
+    t->joined++;
+  else if (how < 0)
+    t->left++;
+  else
+    t->changed++;
+}
+
+static void room_tally_print(gpointer key, gpointer value, gpointer data)
+{
+  const char *roomjid = key;
+  struct room_tally *t = value;
+  GString *sbuf = g_string_new(NULL);
+
+  if (t->joined)
+    g_string_append_printf(sbuf, "%u occupant%s joined", t->joined,
+                           t->joined > 1 ? "s" : "");
+  if (t->left)
+    g_string_append_printf(sbuf, "%s%u occupant%s left",
+                           sbuf->len ? ", " : "", t->left,
+                           t->left > 1 ? "s" : "");
+  if (t->changed)
+    g_string_append_printf(sbuf, "%s%u status change%s",
+                           sbuf->len ? ", " : "", t->changed,
+                           t->changed > 1 ? "s" : "");
+
+  scr_WriteIncomingMessage(roomjid, sbuf->str, 0,
+                           HBB_PREFIX_INFO|HBB_PREFIX_NOFLAG, 0);
+  if (settings_opt_get_int("log_muc_conf"))
+    hlog_write_message(roomjid, 0, -1, sbuf->str);
+  g_string_free(sbuf, TRUE);
+}
+
+//  hk_presence_batch_end()
+// Display the batch summary and update the roster.
+void hk_presence_batch_end(void)
+{
+  if (presence_batch.rooms) {
+    g_hash_table_foreach(presence_batch.rooms, room_tally_print, NULL);
+    g_hash_table_destroy(presence_batch.rooms);
+    presence_batch.rooms = NULL;
+  }
+
+  if (presence_batch.changes) {
+    if (presence_batch.summary &&
+        settings_opt_get_int("log_display_presence"))
+      scr_LogPrint(LPRINT_LOGNORM, "%u buddy status changes",
+                   presence_batch.changes);
+    buddylist_build();
+  }
+  update_roster = TRUE;
+
+#ifdef MODULES_ENABLE
+  {
+    char size[16], coalesced[16], changes[16];
+    hk_arg_t args[] = {
+      { "presences", size },
+      { "coalesced", coalesced },
+      { "changes", changes },
+      { NULL, NULL },
+    };
+    g_snprintf(size, sizeof size, "%u", presence_batch.size);
+    g_snprintf(coalesced, sizeof coalesced, "%u", presence_batch.coalesced);
+    g_snprintf(changes, sizeof changes, "%u", presence_batch.changes);
+
+    hk_run_handlers(HOOK_PRESENCE_BATCH, args);
+  }
+#endif
+
+  presence_batch.active = FALSE;
+}
+
 void hk_statuschange(const char *bjid, const char *resname, gchar prio,
                      time_t timestamp, enum imstatus status,
                      const char *status_msg)
@@ -527,7 +674,8 @@ void hk_statuschange(const char *bjid, const char *resname, gchar prio,
 
   st_in_buf = settings_opt_get_int("show_status_in_buffer");
 
-  if (settings_opt_get_int("log_display_presence")) {
+  if (settings_opt_get_int("log_display_presence") &&
+      !hk_presence_batch_summary()) {
     int buddy_format = settings_opt_get_int("buddy_format");
     bn = NULL;
     if (buddy_format) {
@@ -569,8 +717,12 @@ void hk_statuschange(const char *bjid, const char *resname, gchar prio,
 
   roster_setstatus(bjid, rn, prio, status, status_msg, timestamp,
                    role_none, affil_none, NULL);
-  buddylist_build();
-  scr_draw_roster();
+  if (presence_batch.active) {
+    presence_batch.changes++;
+  } else {
+    buddylist_build();
+    scr_draw_roster();
+  }
   hlog_write_status(bjid, timestamp, status, status_msg);
 
 #ifdef MODULES_ENABLE
@@ -24,6 +24,7 @@
 #define HOOK_PRE_DISCONNECT     "hook-pre-disconnect"
 #define HOOK_UNREAD_LIST_CHANGE "hook-unread-list-change"
 #define HOOK_SUBSCRIPTION       "hook-subscription"
+#define HOOK_PRESENCE_BATCH     "hook-presence-batch"
 
 typedef enum {
   HOOK_HANDLER_RESULT_ALLOW_MORE_HANDLERS = 0,
@@ -51,6 +52,11 @@ void hk_message_in(const char *bjid, const char *resname,
 void hk_message_out(const char *bjid, const char *nickname,
                     time_t timestamp, const char *msg,
                     guint encrypted, gboolean carbon, gpointer xep184);
+void hk_presence_batch_begin(guint size, guint coalesced);
+void hk_presence_batch_end(void);
+gboolean hk_presence_batch_summary(void);
+void hk_presence_batch_room(const char *roomjid, int how);
+
 void hk_statuschange(const char *bjid, const char *resname, gchar prio,
                      time_t timestamp, enum imstatus status,
                      char const *status_msg);
@@ -370,6 +370,8 @@ static gboolean keyboard_activity(void)
     scr_getch(&kcode);
   }
   scr_check_auto_away(FALSE);
+  // Do not delay the echo of keystrokes
+  scr_paint_frame(TRUE);
 
   return TRUE;
 }
@@ -408,18 +410,23 @@ int main(int argc, char **argv)
 
   /* Parse command line options */
   while (1) {
-    int c = getopt(argc, argv, "hVf:");
+    int c = getopt(argc, argv, "hVHf:");
     if (c == -1) {
       break;
     } else
       switch (c) {
       case 'h':
       case '?':
-        printf("Usage: %s [-h|-V|-f mcabberrc_file]\n\n", argv[0]);
+        printf("Usage: %s [-h|-V|-H|-f mcabberrc_file]\n\n", argv[0]);
+        printf("  -H  Offscreen rendering (no terminal output).  Statistics "
+               "and the last screen\n      are printed on exit.\n\n");
         return (c == 'h' ? 0 : -1);
       case 'V':
         compile_options();
         return 0;
+      case 'H':
+        scr_set_offscreen();
+        break;
       case 'f':
         configFile = g_strdup(optarg);
         break;
@@ -427,7 +434,7 @@ int main(int argc, char **argv)
   }
 
   if (optind < argc) {
-    fprintf(stderr, "Usage: %s [-h|-V|-f mcabberrc_file]\n\n", argv[0]);
+    fprintf(stderr, "Usage: %s [-h|-V|-H|-f mcabberrc_file]\n\n", argv[0]);
     return -1;
   }
 
@@ -528,6 +535,7 @@ int main(int argc, char **argv)
 
   /* Load previous roster state */
   hlog_load_state();
+  roster_cache_load();
 
   main_context = g_main_context_default();
 
@@ -565,9 +573,8 @@ int main(int argc, char **argv)
         sigwinch = FALSE;
       }
 #endif
-      if (update_roster)
-        scr_draw_roster();
-      scr_do_update();
+      xmpp_flush_presences();
+      scr_paint_frame(FALSE);
     }
 
     g_source_destroy(mc_source);
@@ -597,6 +604,7 @@ int main(int argc, char **argv)
   scr_terminate_curses();
   /* Save pending message state */
   hlog_save_state();
+  roster_cache_save();
   caps_free();
 
   printf("\n\nThanks for using mcabber!\n");
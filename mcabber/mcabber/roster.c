@@ -19,11 +19,19 @@
  * USA
  */
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
 
 #include "roster.h"
 #include "utils.h"
+#include "utf8.h"
 #include "hooks.h"
+#include "settings.h"
+#include "logprint.h"
 
 extern void hlog_save_state(void);
 
@@ -66,50 +74,74 @@ char *strflagjoins[] = {    /* Should match enum in roster.h */
 
 typedef struct {
   gchar *name;
-  gchar prio;
-  enum imstatus status;
   gchar *status_msg;
   time_t status_timestamp;
-  enum imrole role;
-  enum imaffiliation affil;
   gchar *realjid;       /* for chatrooms, if buddy's real jid is known */
-  guint events;
   char *caps;
 #ifdef XEP0085
-  struct xep0085 xep85;
+  struct xep0085 *xep85;    /* allocated on first use */
 #endif
 #ifdef HAVE_GPGME
-  struct pgp_data pgpdata;
+  struct pgp_data *pgpdata; /* allocated on first use */
 #endif
+  enum imstatus status;
+  guint events;
+  gchar prio;
+  guint8 role;          /* enum imrole */
+  guint8 affil;         /* enum imaffiliation */
 } res;
 
-/* This is a private structure type for the roster */
+/* Groupchat data, only allocated for chatrooms */
 
 typedef struct {
-  gchar *name;
-  gchar *jid;
-  guint type;
-  enum subscr subscription;
-  GSList *resource;
-  res *active_resource;
-
-  /* For groupchats */
   gchar *nickname;
   gchar *topic;
   guint inside_room;
-  guint print_status;
-  guint auto_whois;
-  guint flag_joins;
+  guint8 print_status;  /* enum room_printstatus */
+  guint8 auto_whois;    /* enum room_autowhois */
+  guint8 flag_joins;    /* enum room_flagjoins */
+} roster_muc;
+
+/* Group data: counters maintained when the members change, so that we
+   don't have to walk through the members list to get them */
+
+typedef struct {
+  guint nstatus[imstatus_size]; // Number of members for each status
+  guint unread;                 // Number of members with unread messages
+} roster_group;
+
+/* This is a private structure type for the roster */
+
+typedef struct {
+  /* Fields used for every roster redraw or lookup come first */
+  guint type;
+  guint flags;    /* Flags used for the UI */
+  guint ui_prio;  // Boolean, positive if "attention" is requested
+  guint serial;   // Changes with the roster line, see roster_touch()
+  guint8 subscription;  /* enum subscr */
 
   /* on_server is TRUE if the item is present on the server roster */
-  guint on_server;
+  guint8 on_server;
+  /* from_cache is TRUE if the item comes from the roster cache and
+     hasn't been seen in the server roster yet */
+  guint8 from_cache;
+
+  gchar *name;
+  gchar *jid;
+  /* name and jid in the user's locale, if it isn't UTF-8 (set when needed) */
+  gchar *name_locale;
+  gchar *jid_locale;
+  GSList *resource;
+  res *active_resource;
 
   /* To keep track of last status message */
   gchar *offline_status_message;
 
-  /* Flag used for the UI */
-  guint flags;
-  guint ui_prio;  // Boolean, positive if "attention" is requested
+  /* Type-specific data (NULL for regular buddies) */
+  union {
+    roster_muc *muc;      // Chatrooms
+    roster_group *group;  // Groups
+  } u;
 
   // list: user -> points to his group; group -> points to its users list
   GSList *list;
@@ -120,8 +152,14 @@ typedef struct {
 
 static guchar display_filter;
 static GSList *groups;
+static GHashTable *groups_hash;   // Group name -> groups list element
 static GSList *unread_list;
 static GHashTable *unread_jids;
+static GSList *compl_jids;        // Completion sources, in the user's locale
+static GSList *compl_groups;
+static guint buddylist_len;
+static guint buddylist_serial;
+static guint display_serial;
 GList *buddylist;
 GList *current_buddy;
 GList *alternate_buddy;
@@ -130,6 +168,8 @@ GList *last_activity_buddy;
 static roster roster_special;
 
 static int  unread_jid_del(const char *jid);
+static void roster_cache_touch(void);
+static void compl_list_invalidate(void);
 
 #define DFILTER_ALL     63
 #define DFILTER_ONLINE  62
@@ -152,8 +192,14 @@ static inline void free_resource_data(res *p_res)
   g_free((gchar*)p_res->status_msg);
   g_free((gchar*)p_res->name);
   g_free((gchar*)p_res->realjid);
+#ifdef XEP0085
+  g_free(p_res->xep85);
+#endif
 #ifdef HAVE_GPGME
-  g_free(p_res->pgpdata.sign_keyid);
+  if (p_res->pgpdata) {
+    g_free(p_res->pgpdata->sign_keyid);
+    g_free(p_res->pgpdata);
+  }
 #endif
   g_free(p_res->caps);
   g_free(p_res);
@@ -257,6 +303,8 @@ static void del_resource(roster *rost, const char *resname)
     g_free(rost->offline_status_message);
     rost->offline_status_message = p_res->status_msg;
     p_res->status_msg = NULL;
+    if (rost->on_server)
+      roster_cache_touch();
   }
 
   if (rost->active_resource == p_res)
@@ -271,6 +319,30 @@ static void del_resource(roster *rost, const char *resname)
 
 /* ### Roster functions ### */
 
+//  roster_name_locale(roster_elt)
+// Return the name of the roster item, in the user's locale.
+// No conversion is needed for UTF-8 locales; otherwise the converted name
+// is kept with the item so that it is converted only once.
+static const char *roster_name_locale(roster *roster_elt)
+{
+  if (utf8_mode || !roster_elt->name)
+    return roster_elt->name;
+  if (!roster_elt->name_locale)
+    roster_elt->name_locale = from_utf8(roster_elt->name);
+  return roster_elt->name_locale;
+}
+
+//  roster_jid_locale(roster_elt)
+// Same as roster_name_locale(), for the jid of the roster item.
+static const char *roster_jid_locale(roster *roster_elt)
+{
+  if (utf8_mode || !roster_elt->jid)
+    return roster_elt->jid;
+  if (!roster_elt->jid_locale)
+    roster_elt->jid_locale = from_utf8(roster_elt->jid);
+  return roster_elt->jid_locale;
+}
+
 static inline void free_roster_user_data(roster *roster_usr)
 {
   if (!roster_usr)
@@ -278,13 +350,122 @@ static inline void free_roster_user_data(roster *roster_usr)
   g_free((gchar*)roster_usr->jid);
   //g_free((gchar*)roster_usr->active_resource);
   g_free((gchar*)roster_usr->name);
-  g_free((gchar*)roster_usr->nickname);
-  g_free((gchar*)roster_usr->topic);
+  g_free(roster_usr->jid_locale);
+  g_free(roster_usr->name_locale);
+  if (roster_usr->u.muc) {
+    g_free((gchar*)roster_usr->u.muc->nickname);
+    g_free((gchar*)roster_usr->u.muc->topic);
+    g_free(roster_usr->u.muc);
+  }
   g_free((gchar*)roster_usr->offline_status_message);
   free_all_resources(&roster_usr->resource);
   g_free(roster_usr);
 }
 
+//  get_muc_data(rost, create)
+// Return the groupchat data of rost.  If there is none yet, they are
+// allocated when create is TRUE, otherwise NULL is returned.
+static roster_muc *get_muc_data(roster *rost, guint create)
+{
+  if (rost->type & ROSTER_TYPE_GROUP)
+    return NULL;
+  if (!rost->u.muc && create)
+    rost->u.muc = g_new0(roster_muc, 1);
+  return rost->u.muc;
+}
+
+//  roster_touch(item)
+// Give a new serial number to the roster item, and to its group since
+// the group line displays counters.  The serial numbers are never reused,
+// so that the roster window can tell which items have to be redrawn.
+static void roster_touch(roster *item)
+{
+  item->serial = ++display_serial;
+  if (item->list && !(item->type & (ROSTER_TYPE_GROUP|ROSTER_TYPE_SPECIAL)))
+    ((roster*)item->list->data)->serial = display_serial;
+}
+
+/* ### Group counters ### */
+
+//  user_group_data(usr)
+// Return the counters of the group the user belongs to, or NULL.
+static roster_group *user_group_data(roster *usr)
+{
+  if (!usr->list || (usr->type & (ROSTER_TYPE_GROUP|ROSTER_TYPE_SPECIAL)))
+    return NULL;
+  return ((roster*)usr->list->data)->u.group;
+}
+
+//  group_count_user(usr, add)
+// Add the user to (if add is TRUE) or remove the user from
+// the counters of their group.
+static void group_count_user(roster *usr, guint add)
+{
+  roster_group *grp = user_group_data(usr);
+  enum imstatus st;
+
+  roster_touch(usr);
+  if (!grp) return;
+
+  st = buddy_getstatus(usr, NULL);
+  if (add) {
+    grp->nstatus[st]++;
+    if (usr->flags & ROSTER_FLAG_MSG)
+      grp->unread++;
+  } else {
+    grp->nstatus[st]--;
+    if (usr->flags & ROSTER_FLAG_MSG)
+      grp->unread--;
+  }
+}
+
+//  group_update_status(usr, oldstatus)
+// Update the group counters after a (possible) status change of the user.
+static void group_update_status(roster *usr, enum imstatus oldstatus)
+{
+  roster_group *grp = user_group_data(usr);
+  enum imstatus newstatus;
+
+  roster_touch(usr);
+  if (!grp) return;
+
+  newstatus = buddy_getstatus(usr, NULL);
+  if (newstatus != oldstatus) {
+    grp->nstatus[oldstatus]--;
+    grp->nstatus[newstatus]++;
+  }
+}
+
+//  user_setflags(usr, flags)
+// Set the user flags, and update the group unread messages counter.
+static void user_setflags(roster *usr, guint flags)
+{
+  roster_group *grp = user_group_data(usr);
+
+  if (grp && ((usr->flags ^ flags) & ROSTER_FLAG_MSG)) {
+    if (flags & ROSTER_FLAG_MSG)
+      grp->unread++;
+    else
+      grp->unread--;
+  }
+  usr->flags = flags;
+  roster_touch(usr);
+}
+
+//  free_group(grp)
+// Free a group; the group should be empty.
+static void free_group(roster *roster_grp)
+{
+  if (groups_hash)
+    g_hash_table_remove(groups_hash, roster_grp->name);
+  compl_list_invalidate();
+  g_free((gchar*)roster_grp->jid);
+  g_free((gchar*)roster_grp->name);
+  g_free(roster_grp->name_locale);
+  g_free(roster_grp->u.group);
+  g_free(roster_grp);
+}
+
 // Comparison function used to search in the roster (compares jids and types)
 static gint roster_compare_jid_type(roster *a, roster *b) {
   if (! (a->type & b->type))
@@ -320,6 +501,13 @@ GSList *roster_find(const char *jidname, enum findwhat type, guint roster_type)
     roster_type = ROSTER_TYPE_USER  | ROSTER_TYPE_ROOM |
                   ROSTER_TYPE_AGENT | ROSTER_TYPE_GROUP;
 
+  // Groups are indexed by name
+  if (type == namesearch && roster_type == ROSTER_TYPE_GROUP) {
+    if (!groups_hash)
+      return NULL;
+    return g_hash_table_lookup(groups_hash, jidname);
+  }
+
   sample.type = roster_type;
   if (type == jidsearch) {
     sample.jid = (gchar*)jidname;
@@ -349,17 +537,26 @@ GSList *roster_add_group(const char *name)
   roster *roster_grp;
   GSList *p_group;
 
+  if (!name) return NULL;
+
+  if (!groups_hash)
+    groups_hash = g_hash_table_new(g_str_hash, g_str_equal);
+
   // #1 Check name doesn't already exist
-  p_group = roster_find(name, namesearch, ROSTER_TYPE_GROUP);
+  p_group = g_hash_table_lookup(groups_hash, name);
   if (!p_group) {
     // #2 Create the group node
     roster_grp = g_new0(roster, 1);
     roster_grp->name = g_strdup(name);
     roster_grp->type = ROSTER_TYPE_GROUP;
+    roster_grp->u.group = g_new0(roster_group, 1);
+    roster_touch(roster_grp);
     // #3 Insert (sorted)
     groups = g_slist_insert_sorted(groups, roster_grp,
             (GCompareFunc)&roster_compare_name);
-    p_group = roster_find(name, namesearch, ROSTER_TYPE_GROUP);
+    p_group = g_slist_find(groups, roster_grp);
+    g_hash_table_insert(groups_hash, roster_grp->name, p_group);
+    compl_list_invalidate();
   }
   return p_group;
 }
@@ -394,7 +591,11 @@ GSList *roster_add_user(const char *jid, const char *name, const char *group,
     char *oldgroupname;
     // That's an update
     roster_usr = slist->data;
-    roster_usr->subscription = esub;
+    if (roster_usr->subscription != esub) {
+      roster_usr->subscription = esub;
+      roster_touch(roster_usr);
+      roster_cache_touch();
+    }
     if (onserver >= 0)
       buddy_setonserverflag(slist->data, onserver);
     if (name)
@@ -434,11 +635,15 @@ GSList *roster_add_user(const char *jid, const char *name, const char *group,
   roster_usr->type = type;
   roster_usr->subscription = esub;
   roster_usr->list = slist;    // (my_group SList element)
-  if (onserver == 1)
+  if (onserver == 1) {
     roster_usr->on_server = TRUE;
+    roster_cache_touch();
+  }
   // #4 Insert node (sorted)
   my_group->list = g_slist_insert_sorted(my_group->list, roster_usr,
                                          (GCompareFunc)&roster_compare_name);
+  group_count_user(roster_usr, TRUE);
+  compl_list_invalidate();
   return roster_find(jid, jidsearch, type);
 }
 
@@ -465,6 +670,12 @@ void roster_del_user(const char *jid)
 
   sl_group = roster_usr->list;
 
+  if (roster_usr->on_server || roster_usr->from_cache)
+    roster_cache_touch();
+
+  group_count_user(roster_usr, FALSE);
+  compl_list_invalidate();
+
   // Let's free roster_usr memory (jid, name, status message...)
   free_roster_user_data(roster_usr);
 
@@ -508,12 +719,19 @@ void roster_free(void)
     // Free group's users list
     if (roster_grp->list)
       g_slist_free(roster_grp->list);
-    // Free group's name and jid
+    // Free group's name, jid and counters
     g_free((gchar*)roster_grp->jid);
     g_free((gchar*)roster_grp->name);
+    g_free(roster_grp->name_locale);
+    g_free(roster_grp->u.group);
     g_free(roster_grp);
     sl_grp = g_slist_next(sl_grp);
   }
+  if (groups_hash) {
+    g_hash_table_destroy(groups_hash);
+    groups_hash = NULL;
+  }
+  compl_list_invalidate();
   // Free groups list
   if (groups) {
     g_slist_free(groups);
@@ -535,6 +753,7 @@ void roster_setstatus(const char *jid, const char *resname, gchar prio,
   GSList *sl_user;
   roster *roster_usr;
   res *p_res;
+  enum imstatus oldstatus;
 
   sl_user = roster_find(jid, jidsearch,
                         ROSTER_TYPE_USER|ROSTER_TYPE_ROOM|ROSTER_TYPE_AGENT);
@@ -547,6 +766,7 @@ void roster_setstatus(const char *jid, const char *resname, gchar prio,
   if (!resname) return;
 
   roster_usr = (roster*)sl_user->data;
+  oldstatus = buddy_getstatus(roster_usr, NULL);
 
   // New or updated resource
   p_res = get_or_add_resource(roster_usr, resname, prio);
@@ -572,10 +792,10 @@ void roster_setstatus(const char *jid, const char *resname, gchar prio,
     p_res->realjid = g_strdup(realjid);
 
   // If bstat is offline, we MUST delete the resource, actually
-  if (bstat == offline) {
+  if (bstat == offline)
     del_resource(roster_usr, resname);
-    return;
-  }
+
+  group_update_status(roster_usr, oldstatus);
 }
 
 //  roster_setflags()
@@ -592,9 +812,9 @@ void roster_setflags(const char *jid, guint flags, guint value)
 
   roster_usr = (roster*)sl_user->data;
   if (value)
-    roster_usr->flags |= flags;
+    user_setflags(roster_usr, roster_usr->flags | flags);
   else
-    roster_usr->flags &= ~flags;
+    user_setflags(roster_usr, roster_usr->flags & ~flags);
 }
 
 //  roster_unread_check()
@@ -662,6 +882,7 @@ void roster_msg_setflag(const char *jid, guint special, guint value)
           unread_list = g_slist_delete_link(unread_list, node);
       }
     }
+    roster_touch(roster_usr);
     goto roster_msg_setflag_return;
   }
 
@@ -680,7 +901,7 @@ void roster_msg_setflag(const char *jid, guint special, guint value)
       unread_list_modified = TRUE;
     // Message flag is TRUE.  This is easy, we just have to set both flags
     // to TRUE...
-    roster_usr->flags |= ROSTER_FLAG_MSG;
+    user_setflags(roster_usr, roster_usr->flags | ROSTER_FLAG_MSG);
     roster_grp->flags |= ROSTER_FLAG_MSG; // group
     // Append the roster_usr to unread_list, but avoid duplicates
     if (!g_slist_find(unread_list, roster_usr))
@@ -688,35 +909,20 @@ void roster_msg_setflag(const char *jid, guint special, guint value)
                                       (GCompareFunc)&_roster_compare_uiprio);
   } else {
     // Message flag is FALSE.
-    guint msg = FALSE;
     if (roster_usr->flags & ROSTER_FLAG_MSG)
       unread_list_modified = TRUE;
-    roster_usr->flags &= ~ROSTER_FLAG_MSG;
+    user_setflags(roster_usr, roster_usr->flags & ~ROSTER_FLAG_MSG);
     roster_usr->ui_prio = 0;
     if (unread_list) {
       GSList *node = g_slist_find(unread_list, roster_usr);
       if (node)
         unread_list = g_slist_delete_link(unread_list, node);
     }
-    // For the group value we need to watch all buddies in this group;
-    // if one is flagged, then the group will be flagged.
-    // I will re-use sl_user and roster_usr here, as they aren't used
-    // anymore.
-    sl_user = roster_grp->list;
-    while (sl_user) {
-      roster_usr = (roster*)sl_user->data;
-      if (roster_usr->flags & ROSTER_FLAG_MSG) {
-        msg = TRUE;
-        break;
-      }
-      sl_user = g_slist_next(sl_user);
-    }
-    if (!msg)
-      roster_grp->flags &= ~ROSTER_FLAG_MSG;
-    else
+    // The group is flagged if one of its members is flagged.
+    if (roster_grp->u.group->unread)
       roster_grp->flags |= ROSTER_FLAG_MSG;
-      // Actually the "else" part is useless, because the group
-      // ROSTER_FLAG_MSG should already be set...
+    else
+      roster_grp->flags &= ~ROSTER_FLAG_MSG;
   }
 
   if (buddylist && (new_roster_item || !g_list_find(buddylist, roster_usr)))
@@ -758,6 +964,7 @@ void roster_setuiprio(const char *jid, guint special, guint value,
     newval = value;
 
   roster_usr->ui_prio = newval;
+  roster_touch(roster_usr);
   unread_list = g_slist_sort(unread_list,
                              (GCompareFunc)&_roster_compare_uiprio);
   roster_unread_check();
@@ -798,15 +1005,13 @@ const char *roster_getname(const char *jid)
 const char *roster_getnickname(const char *jid)
 {
   GSList *sl_user;
-  roster *roster_usr;
 
   sl_user = roster_find(jid, jidsearch,
                         ROSTER_TYPE_USER|ROSTER_TYPE_ROOM|ROSTER_TYPE_AGENT);
   if (sl_user == NULL)
     return NULL; // Not in the roster...
 
-  roster_usr = (roster*)sl_user->data;
-  return roster_usr->nickname;
+  return buddy_getnickname(sl_user->data);
 }
 
 void roster_settype(const char *jid, guint type)
@@ -819,6 +1024,7 @@ void roster_settype(const char *jid, guint type)
 
   roster_usr = (roster*)sl_user->data;
   roster_usr->type = type;
+  roster_touch(roster_usr);
 }
 
 enum imstatus roster_getstatus(const char *jid, const char *resname)
@@ -903,16 +1109,81 @@ void roster_unsubscribed(const char *jid)
 {
   GSList *sl_user;
   roster *roster_usr;
+  enum imstatus oldstatus;
 
   sl_user = roster_find(jid, jidsearch, ROSTER_TYPE_USER|ROSTER_TYPE_AGENT);
   if (sl_user == NULL)
     return;
 
   roster_usr = (roster*)sl_user->data;
+  oldstatus = buddy_getstatus(roster_usr, NULL);
   free_all_resources(&roster_usr->resource);
+  roster_usr->active_resource = NULL;
+  group_update_status(roster_usr, oldstatus);
 }
 
 
+//  roster_memusage(nitems, nbytes)
+// Compute the memory used by the roster items (structures, strings,
+// resources and list nodes, without the allocator overhead).
+void roster_memusage(guint *nitems, gsize *nbytes)
+{
+  GSList *sl_grp, *sl_usr, *sl_res;
+  guint items = 0;
+  gsize bytes = 0;
+
+  for (sl_grp = groups; sl_grp; sl_grp = g_slist_next(sl_grp)) {
+    roster *roster_grp = (roster*)sl_grp->data;
+    bytes += sizeof(roster) + sizeof(roster_group) + sizeof(GSList);
+    if (roster_grp->name)
+      bytes += strlen(roster_grp->name) + 1;
+    for (sl_usr = roster_grp->list; sl_usr; sl_usr = g_slist_next(sl_usr)) {
+      roster *roster_usr = (roster*)sl_usr->data;
+      items++;
+      bytes += sizeof(roster) + sizeof(GSList);
+      bytes += strlen(roster_usr->jid) + 1;
+      if (roster_usr->name)
+        bytes += strlen(roster_usr->name) + 1;
+      if (roster_usr->offline_status_message)
+        bytes += strlen(roster_usr->offline_status_message) + 1;
+      if (roster_usr->u.muc) {
+        bytes += sizeof(roster_muc);
+        if (roster_usr->u.muc->nickname)
+          bytes += strlen(roster_usr->u.muc->nickname) + 1;
+        if (roster_usr->u.muc->topic)
+          bytes += strlen(roster_usr->u.muc->topic) + 1;
+      }
+      for (sl_res = roster_usr->resource; sl_res;
+           sl_res = g_slist_next(sl_res)) {
+        res *r = sl_res->data;
+        bytes += sizeof(res) + sizeof(GSList);
+        bytes += strlen(r->name) + 1;
+        if (r->status_msg)
+          bytes += strlen(r->status_msg) + 1;
+        if (r->realjid)
+          bytes += strlen(r->realjid) + 1;
+        if (r->caps)
+          bytes += strlen(r->caps) + 1;
+#ifdef XEP0085
+        if (r->xep85)
+          bytes += sizeof(struct xep0085);
+#endif
+#ifdef HAVE_GPGME
+        if (r->pgpdata) {
+          bytes += sizeof(struct pgp_data);
+          if (r->pgpdata->sign_keyid)
+            bytes += strlen(r->pgpdata->sign_keyid) + 1;
+        }
+#endif
+      }
+    }
+  }
+  if (nitems)
+    *nitems = items;
+  if (nbytes)
+    *nbytes = bytes;
+}
+
 /* ### BuddyList functions ### */
 
 //  buddylist_set_hide_offline_buddies(hide)
@@ -951,6 +1222,23 @@ guchar buddylist_get_filter(void)
   return display_filter;
 }
 
+//  buddylist_add_node(rosterdata, cur, alt, last)
+// Prepend rosterdata to the buddylist being built by buddylist_build(),
+// and restore the current, alternate and last activity buddies if
+// rosterdata is one of them.
+static void buddylist_add_node(roster *rosterdata, roster *cur, roster *alt,
+                               roster *last)
+{
+  buddylist = g_list_prepend(buddylist, rosterdata);
+  buddylist_len++;
+  if (rosterdata == cur)
+    current_buddy = buddylist;
+  if (rosterdata == alt)
+    alternate_buddy = buddylist;
+  if (rosterdata == last)
+    last_activity_buddy = buddylist;
+}
+
 //  buddylist_build()
 // Creates the buddylist from the roster entries.
 void buddylist_build(void)
@@ -979,7 +1267,11 @@ void buddylist_build(void)
     buddylist = NULL;
   }
 
-  buddylist = g_list_append(buddylist, &roster_special);
+  // The list is built in reverse order, and reversed at the end.
+  buddylist_len = 0;
+  buddylist_serial++;
+  buddylist_add_node(&roster_special, roster_current_buddy,
+                     roster_alternate_buddy, roster_last_activity_buddy);
 
   // Create the new list
   while (sl_roster_elt) {
@@ -1008,7 +1300,9 @@ void buddylist_build(void)
         // This user should be added.  Maybe the group hasn't been added yet?
         if (pending_group) {
           // It hasn't been done yet
-          buddylist = g_list_append(buddylist, roster_elt);
+          buddylist_add_node(roster_elt, roster_current_buddy,
+                             roster_alternate_buddy,
+                             roster_last_activity_buddy);
           pending_group = FALSE;
         }
         // Add user
@@ -1016,7 +1310,9 @@ void buddylist_build(void)
         //     the group is shrunk? If so, we'd need to check LOCK flag too,
         //     perhaps...
         if (!shrunk_group)
-          buddylist = g_list_append(buddylist, roster_usrelt);
+          buddylist_add_node(roster_usrelt, roster_current_buddy,
+                             roster_alternate_buddy,
+                             roster_last_activity_buddy);
       }
 
       sl_roster_usrelt = g_slist_next(sl_roster_usrelt);
@@ -1024,16 +1320,36 @@ void buddylist_build(void)
     sl_roster_elt = g_slist_next(sl_roster_elt);
   }
 
-  // Check if we can find our saved current_buddy...
-  if (roster_current_buddy)
-    current_buddy = g_list_find(buddylist, roster_current_buddy);
-  if (roster_alternate_buddy)
-    alternate_buddy = g_list_find(buddylist, roster_alternate_buddy);
-  if (roster_last_activity_buddy)
-    last_activity_buddy = g_list_find(buddylist, roster_last_activity_buddy);
+  buddylist = g_list_reverse(buddylist);
+
   // current_buddy initialization
-  if (!current_buddy || (g_list_position(buddylist, current_buddy) == -1))
-    current_buddy = g_list_first(buddylist);
+  // (If it has been found, buddylist_add_node() has restored it.)
+  if (!current_buddy)
+    current_buddy = buddylist;
+}
+
+//  buddylist_get_length()
+// Return the number of items in the buddylist.
+guint buddylist_get_length(void)
+{
+  return buddylist_len;
+}
+
+//  buddylist_get_serial()
+// Return a number which changes each time the buddylist is rebuilt,
+// so that the UI can tell if its buddylist pointers are still valid.
+guint buddylist_get_serial(void)
+{
+  return buddylist_serial;
+}
+
+//  buddy_getserial(roster_data)
+// Return the serial number of the roster item, which changes whenever
+// its roster line may change.
+guint buddy_getserial(gpointer rosterdata)
+{
+  roster *roster_usr = rosterdata;
+  return roster_usr->serial;
 }
 
 //  buddy_hide_group(roster, hide)
@@ -1047,6 +1363,7 @@ void buddy_hide_group(gpointer rosterdata, int hide)
     roster_usr->flags ^= ROSTER_FLAG_HIDE;
   else                              // FALSE  (don't hide)
     roster_usr->flags &= ~ROSTER_FLAG_HIDE;
+  roster_touch(roster_usr);
 }
 
 const char *buddy_getjid(gpointer rosterdata)
@@ -1076,26 +1393,28 @@ void buddy_setgroup(gpointer rosterdata, char *newgroupname)
   if (!newgroupname)  newgroupname = "";
   sl_newgroup = roster_add_group(newgroupname);
   if (!sl_newgroup) return;
+  if (sl_newgroup == roster_usr->list) return;  // Same group
   my_newgroup = (roster*)sl_newgroup->data;
 
   // Remove the buddy from current group
+  group_count_user(roster_usr, FALSE);
   sl_group = &((roster*)((GSList*)roster_usr->list)->data)->list;
   *sl_group = g_slist_remove(*sl_group, rosterdata);
 
   // Remove old group if it is empty
   if (!*sl_group) {
     roster *roster_grp = (roster*)((GSList*)roster_usr->list)->data;
-    g_free((gchar*)roster_grp->jid);
-    g_free((gchar*)roster_grp->name);
-    g_free(roster_grp);
     groups = g_slist_remove(groups, roster_grp);
+    free_group(roster_grp);
   }
 
   // Add the buddy to its new group
   roster_usr->list = sl_newgroup;    // (my_newgroup SList element)
   my_newgroup->list = g_slist_insert_sorted(my_newgroup->list, roster_usr,
                                             (GCompareFunc)&roster_compare_name);
+  group_count_user(roster_usr, TRUE);
 
+  roster_cache_touch();
   buddylist_build();
 }
 
@@ -1113,13 +1432,17 @@ void buddy_setname(gpointer rosterdata, char *newname)
     g_free((gchar*)roster_usr->name);
     roster_usr->name = NULL;
   }
+  g_free(roster_usr->name_locale);
+  roster_usr->name_locale = NULL;
   if (newname)
     roster_usr->name = g_strdup(newname);
+  roster_touch(roster_usr);
 
   // We need to resort the group list
   sl_group = &((roster*)((GSList*)roster_usr->list)->data)->list;
   *sl_group = g_slist_sort(*sl_group, (GCompareFunc)&roster_compare_name);
 
+  roster_cache_touch();
   buddylist_build();
 }
 
@@ -1134,21 +1457,27 @@ const char *buddy_getname(gpointer rosterdata)
 void buddy_setnickname(gpointer rosterdata, const char *newname)
 {
   roster *roster_usr = rosterdata;
+  roster_muc *muc;
 
   if (!(roster_usr->type & ROSTER_TYPE_ROOM)) return; // XXX Error message?
 
-  if (roster_usr->nickname) {
-    g_free((gchar*)roster_usr->nickname);
-    roster_usr->nickname = NULL;
+  muc = get_muc_data(roster_usr, newname != NULL);
+  if (!muc) return;
+
+  if (muc->nickname) {
+    g_free((gchar*)muc->nickname);
+    muc->nickname = NULL;
   }
   if (newname)
-    roster_usr->nickname = g_strdup(newname);
+    muc->nickname = g_strdup(newname);
 }
 
 const char *buddy_getnickname(gpointer rosterdata)
 {
-  roster *roster_usr = rosterdata;
-  return roster_usr->nickname;
+  roster_muc *muc = get_muc_data(rosterdata, FALSE);
+  if (!muc)
+    return NULL;
+  return muc->nickname;
 }
 
 //  buddy_setinsideroom(buddy, inside)
@@ -1156,16 +1485,22 @@ const char *buddy_getnickname(gpointer rosterdata)
 void buddy_setinsideroom(gpointer rosterdata, guint inside)
 {
   roster *roster_usr = rosterdata;
+  roster_muc *muc;
 
   if (!(roster_usr->type & ROSTER_TYPE_ROOM)) return;
 
-  roster_usr->inside_room = inside;
+  muc = get_muc_data(roster_usr, inside);
+  if (muc)
+    muc->inside_room = inside;
+  roster_touch(roster_usr);
 }
 
 guint buddy_getinsideroom(gpointer rosterdata)
 {
-  roster *roster_usr = rosterdata;
-  return roster_usr->inside_room;
+  roster_muc *muc = get_muc_data(rosterdata, FALSE);
+  if (!muc)
+    return FALSE;
+  return muc->inside_room;
 }
 
 //  buddy_settopic(buddy, newtopic)
@@ -1173,57 +1508,72 @@ guint buddy_getinsideroom(gpointer rosterdata)
 void buddy_settopic(gpointer rosterdata, const char *newtopic)
 {
   roster *roster_usr = rosterdata;
+  roster_muc *muc;
 
   if (!(roster_usr->type & ROSTER_TYPE_ROOM)) return;
 
-  if (roster_usr->topic) {
-    g_free((gchar*)roster_usr->topic);
-    roster_usr->topic = NULL;
+  muc = get_muc_data(roster_usr, newtopic != NULL);
+  if (!muc) return;
+
+  if (muc->topic) {
+    g_free((gchar*)muc->topic);
+    muc->topic = NULL;
   }
   if (newtopic)
-    roster_usr->topic = g_strdup(newtopic);
+    muc->topic = g_strdup(newtopic);
 }
 
 const char *buddy_gettopic(gpointer rosterdata)
 {
-  roster *roster_usr = rosterdata;
-  return roster_usr->topic;
+  roster_muc *muc = get_muc_data(rosterdata, FALSE);
+  if (!muc)
+    return NULL;
+  return muc->topic;
 }
 
 void buddy_setprintstatus(gpointer rosterdata, enum room_printstatus pstatus)
 {
-  roster *roster_usr = rosterdata;
-  roster_usr->print_status = pstatus;
+  roster_muc *muc = get_muc_data(rosterdata, pstatus != status_default);
+  if (muc)
+    muc->print_status = pstatus;
 }
 
 enum room_printstatus buddy_getprintstatus(gpointer rosterdata)
 {
-  roster *roster_usr = rosterdata;
-  return roster_usr->print_status;
+  roster_muc *muc = get_muc_data(rosterdata, FALSE);
+  if (!muc)
+    return status_default;
+  return muc->print_status;
 }
 
 void buddy_setautowhois(gpointer rosterdata, enum room_autowhois awhois)
 {
-  roster *roster_usr = rosterdata;
-  roster_usr->auto_whois = awhois;
+  roster_muc *muc = get_muc_data(rosterdata, awhois != autowhois_default);
+  if (muc)
+    muc->auto_whois = awhois;
 }
 
 enum room_autowhois buddy_getautowhois(gpointer rosterdata)
 {
-  roster *roster_usr = rosterdata;
-  return roster_usr->auto_whois;
+  roster_muc *muc = get_muc_data(rosterdata, FALSE);
+  if (!muc)
+    return autowhois_default;
+  return muc->auto_whois;
 }
 
 void buddy_setflagjoins(gpointer rosterdata, enum room_flagjoins fjoins)
 {
-  roster *roster_usr = rosterdata;
-  roster_usr->flag_joins = fjoins;
+  roster_muc *muc = get_muc_data(rosterdata, fjoins != flagjoins_default);
+  if (muc)
+    muc->flag_joins = fjoins;
 }
 
 enum room_flagjoins buddy_getflagjoins(gpointer rosterdata)
 {
-  roster *roster_usr = rosterdata;
-  return roster_usr->flag_joins;
+  roster_muc *muc = get_muc_data(rosterdata, FALSE);
+  if (!muc)
+    return flagjoins_default;
+  return muc->flag_joins;
 }
 
 //  buddy_getgroupname()
@@ -1262,6 +1612,7 @@ void buddy_settype(gpointer rosterdata, guint type)
 {
   roster *roster_usr = rosterdata;
   roster_usr->type = type;
+  roster_touch(roster_usr);
 }
 
 guint buddy_gettype(gpointer rosterdata)
@@ -1328,6 +1679,7 @@ void buddy_resource_setevents(gpointer rosterdata, const char *resname,
   res *p_res = get_resource(roster_usr, resname);
   if (p_res)
     p_res->events = events;
+  roster_touch(roster_usr);
 }
 
 char *buddy_resource_getcaps(gpointer rosterdata, const char *resname)
@@ -1350,13 +1702,19 @@ void buddy_resource_setcaps(gpointer rosterdata, const char *resname,
   }
 }
 
+//  buddy_resource_xep85(roster_data, resname)
+// Return the chat states data of the resource; they are allocated the
+// first time they are requested.
 struct xep0085 *buddy_resource_xep85(gpointer rosterdata, const char *resname)
 {
 #ifdef XEP0085
   roster *roster_usr = rosterdata;
   res *p_res = get_resource(roster_usr, resname);
-  if (p_res)
-    return &p_res->xep85;
+  if (p_res) {
+    if (!p_res->xep85)
+      p_res->xep85 = g_new0(struct xep0085, 1);
+    return p_res->xep85;
+  }
 #endif
   return NULL;
 }
@@ -1366,8 +1724,11 @@ struct pgp_data *buddy_resource_pgp(gpointer rosterdata, const char *resname)
 #ifdef HAVE_GPGME
   roster *roster_usr = rosterdata;
   res *p_res = get_resource(roster_usr, resname);
-  if (p_res)
-    return &p_res->pgpdata;
+  if (p_res) {
+    if (!p_res->pgpdata)
+      p_res->pgpdata = g_new0(struct pgp_data, 1);
+    return p_res->pgpdata;
+  }
 #endif
   return NULL;
 }
@@ -1413,9 +1774,30 @@ GSList *buddy_getresources(gpointer rosterdata)
     roster_usr = BUDDATA(current_buddy);
   }
   for (lp = roster_usr->resource; lp; lp = g_slist_next(lp))
-    reslist = g_slist_append(reslist, g_strdup(((res*)lp->data)->name));
+    reslist = g_slist_prepend(reslist, g_strdup(((res*)lp->data)->name));
 
-  return reslist;
+  return g_slist_reverse(reslist);
+}
+
+//  buddy_foreach_resource(roster_data, pfunction, param)
+// Call pfunction(roster_data, resname, param) for each resource of the
+// buddy, from the lowest to the highest priority, without building a list.
+// pfunction must not add or remove resources.
+// If roster_data is null, the current buddy is selected
+void buddy_foreach_resource(gpointer rosterdata,
+                            void (*pfunc)(gpointer rosterdata,
+                                          const char *resname, void *param),
+                            void *param)
+{
+  roster *roster_usr = rosterdata;
+  GSList *lp;
+
+  if (!roster_usr) {
+    if (!current_buddy) return;
+    roster_usr = BUDDATA(current_buddy);
+  }
+  for (lp = roster_usr->resource; lp; lp = g_slist_next(lp))
+    pfunc(roster_usr, ((res*)lp->data)->name, param);
 }
 
 //  buddy_getresources_locale(roster_data)
@@ -1426,6 +1808,8 @@ GSList *buddy_getresources_locale(gpointer rosterdata)
   GSList *reslist, *lp;
 
   reslist = buddy_getresources(rosterdata);
+  if (utf8_mode)
+    return reslist;
   // Convert each item to UI's locale
   for (lp = reslist; lp; lp = g_slist_next(lp)) {
     gchar *oldname = lp->data;
@@ -1501,11 +1885,13 @@ void buddy_resource_setname(gpointer rosterdata, const char *resname,
 void buddy_del_all_resources(gpointer rosterdata)
 {
   roster *roster_usr = rosterdata;
+  enum imstatus oldstatus = buddy_getstatus(roster_usr, NULL);
 
   while (roster_usr->resource) {
     res *r = roster_usr->resource->data;
     del_resource(roster_usr, r->name);
   }
+  group_update_status(roster_usr, oldstatus);
 }
 
 //  buddy_setflags()
@@ -1514,9 +1900,9 @@ void buddy_setflags(gpointer rosterdata, guint flags, guint value)
 {
   roster *roster_usr = rosterdata;
   if (value)
-    roster_usr->flags |= flags;
+    user_setflags(roster_usr, roster_usr->flags | flags);
   else
-    roster_usr->flags &= ~flags;
+    user_setflags(roster_usr, roster_usr->flags & ~flags);
 }
 
 guint buddy_getflags(gpointer rosterdata)
@@ -1531,12 +1917,56 @@ guint buddy_getuiprio(gpointer rosterdata)
   return roster_usr->ui_prio;
 }
 
+//  buddy_getgroupstats(groupdata, total, online, unread)
+// Get the number of members of the group, the number of members which are
+// not offline and the number of members with unread messages.
+// The pointers can be NULL.
+void buddy_getgroupstats(gpointer groupdata, guint *total, guint *online,
+                         guint *unread)
+{
+  roster *roster_grp = groupdata;
+  roster_group *grp;
+  guint i, n = 0;
+
+  if (!(roster_grp->type & ROSTER_TYPE_GROUP))
+    return;
+  grp = roster_grp->u.group;
+
+  for (i = 0; i < imstatus_size; i++)
+    n += grp->nstatus[i];
+  if (total)
+    *total = n;
+  if (online)
+    *online = n - grp->nstatus[offline];
+  if (unread)
+    *unread = grp->unread;
+}
+
+//  buddy_getgroupvisible(groupdata)
+// Return the number of members of the group whose status matches
+// the display filter.
+guint buddy_getgroupvisible(gpointer groupdata)
+{
+  roster *roster_grp = groupdata;
+  guint i, n = 0;
+
+  if (!(roster_grp->type & ROSTER_TYPE_GROUP))
+    return 0;
+
+  for (i = 0; i < imstatus_size; i++)
+    if (buddylist_is_status_filtered(i))
+      n += roster_grp->u.group->nstatus[i];
+  return n;
+}
+
 //  buddy_setonserverflag()
 // Set the on_server flag
 void buddy_setonserverflag(gpointer rosterdata, guint onserver)
 {
   roster *roster_usr = rosterdata;
   roster_usr->on_server = onserver;
+  // The item has been confirmed (or removed) by the server
+  roster_usr->from_cache = FALSE;
 }
 
 guint buddy_getonserverflag(gpointer rosterdata)
@@ -1574,8 +2004,7 @@ GList *buddy_search(char *string)
   roster *roster_usr;
   if (!buddylist || !current_buddy) return NULL;
   for (;;) {
-    gchar *jid_locale, *name_locale;
-    char *found = NULL;
+    const char *jid_locale, *name_locale;
 
     buddy = g_list_next(buddy);
     if (!buddy)
@@ -1583,20 +2012,12 @@ GList *buddy_search(char *string)
 
     roster_usr = (roster*)buddy->data;
 
-    jid_locale = from_utf8(roster_usr->jid);
-    if (jid_locale) {
-      found = strcasestr(jid_locale, string);
-      g_free(jid_locale);
-      if (found)
-        return buddy;
-    }
-    name_locale = from_utf8(roster_usr->name);
-    if (name_locale) {
-      found = strcasestr(name_locale, string);
-      g_free(name_locale);
-      if (found)
-        return buddy;
-    }
+    jid_locale = roster_jid_locale(roster_usr);
+    if (jid_locale && strcasestr(jid_locale, string))
+      return buddy;
+    name_locale = roster_name_locale(roster_usr);
+    if (name_locale && strcasestr(name_locale, string))
+      return buddy;
 
     if (buddy == current_buddy)
       return NULL; // Back to the beginning, and no match found
@@ -1658,44 +2079,78 @@ void foreach_group_member(gpointer groupdata,
   }
 }
 
-//  compl_list(type)
-// Returns a list of jid's or groups.  (For commands completion)
+//  compl_list_invalidate()
+// Drop the completion sources, they will be rebuilt when needed.
+// (The strings belong to the roster items.)
+static void compl_list_invalidate(void)
+{
+  g_slist_free(compl_jids);
+  compl_jids = NULL;
+  g_slist_free(compl_groups);
+  compl_groups = NULL;
+}
+
+//  compl_list_cached(type)
+// Returns the list of jid's or groups, converted to the user's locale.
 // type: ROSTER_TYPE_USER (jid's) or ROSTER_TYPE_GROUP (group names)
-// The list should be freed by the caller after use.
-GSList *compl_list(guint type)
+// The list belongs to the roster and must neither be modified nor freed;
+// it is only valid until the roster is modified.
+GSList *compl_list_cached(guint type)
 {
   GSList *list = NULL;
-  GSList *sl_roster_elt = groups;
-  roster *roster_elt;
+  GSList *sl_roster_elt;
   GSList *sl_roster_usrelt;
-  roster *roster_usrelt;
+  roster *roster_elt;
 
-  while (sl_roster_elt) {       // group list loop
+  if (type == ROSTER_TYPE_GROUP && compl_groups)
+    return compl_groups;
+  if (type != ROSTER_TYPE_GROUP && compl_jids)
+    return compl_jids;
+
+  for (sl_roster_elt = groups; sl_roster_elt;
+       sl_roster_elt = g_slist_next(sl_roster_elt)) { // group list loop
     roster_elt = (roster*) sl_roster_elt->data;
 
     if (roster_elt->type & ROSTER_TYPE_SPECIAL)
       continue; // Skip special items
 
     if (type == ROSTER_TYPE_GROUP) { // (group names)
-      if (roster_elt->name && *(roster_elt->name))
-        list = g_slist_append(list, from_utf8(roster_elt->name));
+      const char *name = roster_name_locale(roster_elt);
+      if (name && *name)
+        list = g_slist_prepend(list, (gpointer)name);
     } else { // ROSTER_TYPE_USER (jid) (or agent, or chatroom...)
-      sl_roster_usrelt = roster_elt->list;
-      while (sl_roster_usrelt) {  // user list loop
-        roster_usrelt = (roster*) sl_roster_usrelt->data;
-
-        if (roster_usrelt->jid)
-          list = g_slist_append(list, from_utf8(roster_usrelt->jid));
-
-        sl_roster_usrelt = g_slist_next(sl_roster_usrelt);
+      for (sl_roster_usrelt = roster_elt->list; sl_roster_usrelt;
+           sl_roster_usrelt = g_slist_next(sl_roster_usrelt)) {
+        const char *jid = roster_jid_locale(sl_roster_usrelt->data);
+        if (jid)
+          list = g_slist_prepend(list, (gpointer)jid);
       }
     }
-    sl_roster_elt = g_slist_next(sl_roster_elt);
   }
+  list = g_slist_reverse(list);
 
+  if (type == ROSTER_TYPE_GROUP)
+    compl_groups = list;
+  else
+    compl_jids = list;
   return list;
 }
 
+//  compl_list(type)
+// Returns a list of jid's or groups.  (For commands completion)
+// type: ROSTER_TYPE_USER (jid's) or ROSTER_TYPE_GROUP (group names)
+// The list should be freed by the caller after use.
+GSList *compl_list(guint type)
+{
+  GSList *list = NULL;
+  GSList *sl;
+
+  for (sl = compl_list_cached(type); sl; sl = g_slist_next(sl))
+    list = g_slist_prepend(list, g_strdup(sl->data));
+
+  return g_slist_reverse(list);
+}
+
 //  unread_msg(rosterdata)
 // Return the next buddy with an unread message.  If the parameter is NULL,
 // return the first buddy with an unread message.
@@ -1721,6 +2176,270 @@ gpointer unread_msg(gpointer rosterdata)
 }
 
 
+/* ### Roster cache ###
+ *
+ * When the "roster_cache" option is set, the roster items (jid, type,
+ * subscription, group, name and last status message) are saved to this
+ * file, so that the roster can be displayed before the server roster is
+ * received, and when we are disconnected.
+ * The cached items are replaced by the server items as soon as the
+ * server roster has been received; the cached items which are not in the
+ * server roster anymore are then removed by roster_cache_purge().
+ * The cache also holds the roster version (XEP-0237), so that the server
+ * only has to send us the changes since the cached roster.
+ */
+
+#define ROSTER_CACHE_VERSION    2
+#define ROSTER_CACHE_SAVE_DELAY 10  // seconds
+
+static gchar *roster_version;   // XEP-0237 roster version of the cache
+static guint roster_cache_dirty;
+static guint roster_cache_loading;
+static guint roster_cache_timer;
+
+static gboolean roster_cache_timeout(gpointer data)
+{
+  roster_cache_timer = 0;
+  roster_cache_save();
+  return FALSE;
+}
+
+//  roster_cache_touch()
+// Mark the roster cache as out-of-date and schedule a save.
+static void roster_cache_touch(void)
+{
+  if (roster_cache_loading || !settings_opt_get("roster_cache"))
+    return;
+  roster_cache_dirty = TRUE;
+  if (!roster_cache_timer)
+    roster_cache_timer = g_timeout_add_seconds(ROSTER_CACHE_SAVE_DELAY,
+                                               roster_cache_timeout, NULL);
+}
+
+// Escape tabulations, newlines and backslashes (g_strcompress() is used
+// to read the fields back).
+static void roster_cache_write_field(FILE *fp, const char *str, char sep)
+{
+  if (str) {
+    for ( ; *str; str++) {
+      if (*str == '\\')
+        fputs("\\\\", fp);
+      else if (*str == '\t')
+        fputs("\\t", fp);
+      else if (*str == '\n')
+        fputs("\\n", fp);
+      else
+        fputc(*str, fp);
+    }
+  }
+  fputc(sep, fp);
+}
+
+//  roster_cache_save()
+// Write the roster cache file, if it has been modified.
+void roster_cache_save(void)
+{
+  GSList *sl_grp, *sl_usr;
+  const char *cachefile = settings_opt_get("roster_cache");
+  char *cachefile_xp, *tmpfile;
+  FILE *fp;
+  int err;
+
+  if (roster_cache_timer) {
+    g_source_remove(roster_cache_timer);
+    roster_cache_timer = 0;
+  }
+
+  if (!cachefile || !roster_cache_dirty)
+    return;
+  roster_cache_dirty = FALSE;
+
+  cachefile_xp = expand_filename(cachefile);
+  tmpfile = g_strdup_printf("%s.new", cachefile_xp);
+
+  fp = fopen(tmpfile, "w");
+  if (!fp) {
+    scr_LogPrint(LPRINT_LOGNORM, "Cannot write roster cache file [%s]",
+                 strerror(errno));
+    goto roster_cache_save_return;
+  }
+  fchmod(fileno(fp), S_IRUSR|S_IWUSR);
+
+  fprintf(fp, "mcabber-roster-cache %d\n", ROSTER_CACHE_VERSION);
+  roster_cache_write_field(fp, roster_version, '\n');
+
+  for (sl_grp = groups; sl_grp; sl_grp = g_slist_next(sl_grp)) {
+    roster *roster_grp = (roster*)sl_grp->data;
+    for (sl_usr = roster_grp->list; sl_usr; sl_usr = g_slist_next(sl_usr)) {
+      roster *roster_usr = (roster*)sl_usr->data;
+      const char *statusmsg;
+      // Rooms are handled by the bookmarks, and we don't want to keep
+      // the items which are not in our server roster.
+      if (!(roster_usr->type & (ROSTER_TYPE_USER|ROSTER_TYPE_AGENT)) ||
+          !(roster_usr->on_server || roster_usr->from_cache))
+        continue;
+      statusmsg = buddy_getstatusmsg(roster_usr, NULL);
+      fprintf(fp, "%u\t%u\t", roster_usr->type, roster_usr->subscription);
+      roster_cache_write_field(fp, roster_usr->jid, '\t');
+      roster_cache_write_field(fp, roster_grp->name, '\t');
+      roster_cache_write_field(fp, roster_usr->name, '\t');
+      roster_cache_write_field(fp, statusmsg, '\n');
+    }
+  }
+
+  err = ferror(fp);
+  if (fclose(fp) || err) {
+    scr_LogPrint(LPRINT_LOGNORM, "Error while writing roster cache file");
+    unlink(tmpfile);
+  } else if (rename(tmpfile, cachefile_xp)) {
+    scr_LogPrint(LPRINT_LOGNORM, "Cannot rename roster cache file [%s]",
+                 strerror(errno));
+    unlink(tmpfile);
+  }
+
+roster_cache_save_return:
+  g_free(tmpfile);
+  g_free(cachefile_xp);
+}
+
+//  roster_cache_load()
+// Read the roster cache file (if any) and add its items to the roster.
+// The items which are already in the roster are left untouched.
+void roster_cache_load(void)
+{
+  const char *cachefile = settings_opt_get("roster_cache");
+  char *cachefile_xp, *content = NULL;
+  char **lines, **line;
+  guint nitems = 0;
+
+  if (!cachefile)
+    return;
+
+  cachefile_xp = expand_filename(cachefile);
+  if (!g_file_get_contents(cachefile_xp, &content, NULL, NULL)) {
+    g_free(cachefile_xp);
+    return;
+  }
+  g_free(cachefile_xp);
+
+  lines = g_strsplit(content, "\n", -1);
+  g_free(content);
+
+  if (!lines[0] || strncmp(lines[0], "mcabber-roster-cache ", 21) ||
+      atoi(lines[0]+21) != ROSTER_CACHE_VERSION || !lines[1]) {
+    scr_LogPrint(LPRINT_LOGNORM, "Ignoring roster cache file "
+                 "(unknown format)");
+    g_strfreev(lines);
+    return;
+  }
+
+  g_free(roster_version);
+  roster_version = NULL;
+  if (*lines[1])
+    roster_version = g_strcompress(lines[1]);
+
+  roster_cache_loading = TRUE;
+  for (line = lines+2; *line; line++) {
+    char **fields = g_strsplit(*line, "\t", 6);
+    if (g_strv_length(fields) == 6 && *fields[2]) {
+      char *jid, *group, *name, *statusmsg;
+      guint type = (guint) atoi(fields[0]);
+      enum subscr esub = (enum subscr) atoi(fields[1]);
+
+      jid       = g_strcompress(fields[2]);
+      group     = g_strcompress(fields[3]);
+      name      = g_strcompress(fields[4]);
+      statusmsg = g_strcompress(fields[5]);
+
+      if (!check_jid_syntax(jid) && !roster_find(jid, jidsearch, 0) &&
+          (type == ROSTER_TYPE_USER || type == ROSTER_TYPE_AGENT)) {
+        GSList *sl_user = roster_add_user(jid, *name ? name : NULL, group,
+                                          type, esub, 0);
+        if (sl_user) {
+          roster *roster_usr = sl_user->data;
+          roster_usr->from_cache = TRUE;
+          if (*statusmsg)
+            roster_usr->offline_status_message = g_strdup(statusmsg);
+          nitems++;
+        }
+      }
+      g_free(jid);
+      g_free(group);
+      g_free(name);
+      g_free(statusmsg);
+    }
+    g_strfreev(fields);
+  }
+  roster_cache_loading = FALSE;
+  g_strfreev(lines);
+
+  if (nitems) {
+    scr_LogPrint(LPRINT_DEBUG, "Roster cache: %u items loaded", nitems);
+    buddylist_build();
+  }
+}
+
+//  roster_cache_confirm()
+// The server has told us the cached roster is up to date (XEP-0237):
+// the cached items are now considered as server items.
+void roster_cache_confirm(void)
+{
+  GSList *sl_grp, *sl_usr;
+
+  for (sl_grp = groups; sl_grp; sl_grp = g_slist_next(sl_grp)) {
+    roster *roster_grp = (roster*)sl_grp->data;
+    for (sl_usr = roster_grp->list; sl_usr; sl_usr = g_slist_next(sl_usr)) {
+      roster *roster_usr = (roster*)sl_usr->data;
+      if (roster_usr->from_cache)
+        buddy_setonserverflag(roster_usr, TRUE);
+    }
+  }
+}
+
+//  roster_setversion(ver)
+// Set the roster version (XEP-0237), or clear it if ver is NULL.
+void roster_setversion(const char *ver)
+{
+  if (!g_strcmp0(ver, roster_version))
+    return;
+  g_free(roster_version);
+  roster_version = g_strdup(ver);
+  roster_cache_touch();
+}
+
+//  roster_getversion()
+// Return the version of the cached roster, or NULL if there is no roster
+// cache or if the version is unknown.
+const char *roster_getversion(void)
+{
+  if (!settings_opt_get("roster_cache"))
+    return NULL;
+  return roster_version;
+}
+
+//  roster_cache_purge()
+// Remove the cached items which have not been found in the server roster.
+// This function should be called once the server roster has been received.
+void roster_cache_purge(void)
+{
+  GSList *sl_grp, *sl_usr, *stale = NULL;
+
+  for (sl_grp = groups; sl_grp; sl_grp = g_slist_next(sl_grp)) {
+    roster *roster_grp = (roster*)sl_grp->data;
+    for (sl_usr = roster_grp->list; sl_usr; sl_usr = g_slist_next(sl_usr)) {
+      roster *roster_usr = (roster*)sl_usr->data;
+      if (roster_usr->from_cache)
+        stale = g_slist_prepend(stale, g_strdup(roster_usr->jid));
+    }
+  }
+
+  for (sl_usr = stale; sl_usr; sl_usr = g_slist_next(sl_usr)) {
+    roster_del_user(sl_usr->data);
+    g_free(sl_usr->data);
+  }
+  g_slist_free(stale);
+}
+
 /* ### "unread_jids" functions ###
  *
  * The unread_jids hash table is used to keep track of the buddies with
@@ -189,8 +189,17 @@ char    roster_getprio(const char *jid, const char *resname);
 guint   roster_gettype(const char *jid);
 guint   roster_getsubscription(const char *jid);
 void    roster_unsubscribed(const char *jid);
+void    roster_memusage(guint *nitems, gsize *nbytes);
+void    roster_cache_load(void);
+void    roster_cache_save(void);
+void    roster_cache_purge(void);
+void    roster_cache_confirm(void);
+void    roster_setversion(const char *ver);
+const char *roster_getversion(void);
 
 void    buddylist_build(void);
+guint   buddylist_get_length(void);
+guint   buddylist_get_serial(void);
 void    buddy_hide_group(gpointer rosterdata, int hide);
 void    buddylist_set_hide_offline_buddies(int hide);
 int     buddylist_isset_filter(void);
@@ -225,6 +234,10 @@ gchar   buddy_getresourceprio(gpointer rosterdata, const char *resname);
 //int   buddy_isresource(gpointer rosterdata);
 GSList *buddy_getresources(gpointer rosterdata);
 GSList *buddy_getresources_locale(gpointer rosterdata);
+void    buddy_foreach_resource(gpointer rosterdata,
+                               void (*pfunc)(gpointer rosterdata,
+                                             const char *resname, void *param),
+                               void *param);
 const char *buddy_getactiveresource(gpointer rosterdata);
 void    buddy_setactiveresource(gpointer rosterdata, const char *resname);
 void    buddy_resource_setname(gpointer rosterdata, const char *resname,
@@ -244,6 +257,10 @@ void    buddy_del_all_resources(gpointer rosterdata);
 void    buddy_setflags(gpointer rosterdata, guint flags, guint value);
 guint   buddy_getflags(gpointer rosterdata);
 guint   buddy_getuiprio(gpointer rosterdata);
+guint   buddy_getserial(gpointer rosterdata);
+void    buddy_getgroupstats(gpointer groupdata, guint *total, guint *online,
+                            guint *unread);
+guint   buddy_getgroupvisible(gpointer groupdata);
 void    buddy_setonserverflag(gpointer rosterdata, guint onserver);
 guint   buddy_getonserverflag(gpointer rosterdata);
 GList  *buddy_search_jid(const char *jid);
@@ -260,6 +277,7 @@ void   unread_jid_add(const char *jid);
 GList *unread_jid_get_list(void);
 
 GSList *compl_list(guint type);
+GSList *compl_list_cached(guint type);
 
 #endif /* __MCABBER_ROSTER_H__ */
 
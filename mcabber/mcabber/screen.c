@@ -25,6 +25,7 @@
 #include <string.h>
 #include <time.h>
 #include <ctype.h>
+#include <sys/time.h>
 
 #include <config.h>
 #include <locale.h>
@@ -59,6 +60,8 @@
 #include "settings.h"
 #include "utils.h"
 #include "xmpp.h"
+#include "csi.h"
+#include "sendq.h"
 #include "main.h"
 
 #define get_color(col)      (COLOR_PAIR(col)|COLOR_ATTRIB[col])
@@ -69,6 +72,8 @@
 #define CHAT_WIN_HEIGHT (maxY-1-Log_Win_Height)
 
 #define DEFAULT_ATTENTION_CHAR '!'
+#define DEFAULT_REDRAW_MAX_FPS  20
+#define LOG_RING_SIZE 256       // Lines kept for the log window
 
 const char *LocaleCharSet = "C";
 
@@ -137,14 +142,24 @@ static char *multiline, *multimode_subj;
 static int roster_no_leading_space;
 
 static bool Curses;
+static bool Offscreen;      // Render into memory only (no terminal)
 static bool log_win_on_top;
 static bool roster_win_on_right;
 static guint autoaway_source = 0;
 
 static char       inputLine[INPUTLINE_LENGTH+1];
-#if defined(WITH_ENCHANT) || defined(WITH_ASPELL)
+// Misspelled chars of inputLine (only set with spell checking support)
 static char       maskLine[INPUTLINE_LENGTH+1];
-#endif
+
+// What the input line window displays, so that only the changed part of
+// the line needs to be printed (see draw_inputline()).
+static struct {
+  char line[INPUTLINE_LENGTH+1];  // inputLine from the displayed offset
+  char mask[INPUTLINE_LENGTH+1];
+  short col[INPUTLINE_LENGTH+1];  // Column of each char start, or -1
+  int offset;
+  int valid;
+} inputline_shown;
 static char      *ptr_inputline;
 static short int  inputline_offset;
 static int    completion_started;
@@ -159,6 +174,88 @@ static time_t chatstate_timestamp;
 static guint  chatstate_timeout_id = 0;
 
 int update_roster;
+static int update_chat;             // The current window needs a repaint
+static guint frame_timer;           // Pending (postponed) frame
+static struct timeval last_frame;   // Time of the last painted frame
+
+// Offscreen rendering: the terminal output is discarded and a copy of the
+// screen cells is kept to count the cells changed by each update.
+static struct {
+  SCREEN *term;
+  const char *termtype;   // Terminal description used by newterm()
+  FILE *out;
+  chtype *cells;
+  chtype *row;
+  int rows, cols;
+  guint updates;          // Calls to doupdate()
+  guint frames;           // Updates which changed at least one cell
+  gulong changed;         // Cells changed by the last frame
+  gulong changed_max;
+  gulong changed_total;
+} offscreen;
+
+// Last lines of the log window (in the user's locale), most recent at
+// position (log_ring.first + log_ring.count - 1) % LOG_RING_SIZE.
+// The window is painted from this ring once per frame.
+static struct {
+  gchar *lines[LOG_RING_SIZE];
+  guint first;
+  guint count;
+  guint pending;    // Lines not displayed yet
+  gboolean full;    // The window has to be repainted entirely
+} log_ring;
+
+// What the chat window displays after its last full repaint, so that new
+// lines can be appended without redrawing the whole window.
+static struct {
+  winbuf *win;        // NULL if unknown or if a full repaint is needed
+  GList  *last;       // hbuf element of the last displayed line
+  int     rows;       // Number of rows in use
+  int     height;
+  guint   prefixwidth;
+  bool    readmark;   // A read mark is displayed
+} chat_painted;
+
+// Roster window rows, as they are displayed, so that only the rows
+// which have changed are formatted and repainted.
+typedef struct {
+  gpointer buddy;     // Roster item, NULL for an empty row
+  guint  serial;      // Serial number of the item when the row was drawn
+  gchar *line;        // Text (in the user's locale), NULL for an empty row
+  int    attr;
+  bool   selected;
+} roster_row;
+
+static struct {
+  roster_row *rows;   // NULL if the window must be fully repainted
+  int     height;
+  int     width;
+  int     x_pos;
+  bool    offline;    // Our own status was offline
+  guchar  filter;     // Buddylist display filter
+  guint   serial;     // Buddylist serial number when top/cursor were saved
+  GList  *top;        // First visible buddylist element
+  int     offset;     // Position of top in the buddylist
+  GList  *cursor;     // Selected buddylist element
+  int     cursor_pos; // Position of cursor in the buddylist
+} roster_view;
+
+//  roster_view_reset()
+// Drop the roster window cache, the next scr_draw_roster() call will
+// repaint the whole window.
+static void roster_view_reset(void)
+{
+  int i;
+
+  if (roster_view.rows) {
+    for (i = 0; i < roster_view.height; i++)
+      g_free(roster_view.rows[i].line);
+    g_free(roster_view.rows);
+  }
+  roster_view.rows = NULL;
+  roster_view.top = NULL;
+  roster_view.cursor = NULL;
+}
 int utf8_mode;
 gboolean chatstates_disabled;
 gboolean Autoaway;
@@ -201,6 +298,23 @@ typedef struct {
 } spell_checker;
 
 GSList* spell_checkers = NULL;
+
+#define SPELL_CACHE_SIZE 512
+
+// Last verdicts of the spell checkers, so that the words of the input
+// line are not checked again at each keystroke.  spell_cache maps a word
+// to its link in spell_lru (most recently used first).
+typedef struct {
+  gchar *word;
+  gboolean good;
+} spell_verdict;
+
+static GHashTable *spell_cache;
+static GQueue spell_lru = G_QUEUE_INIT;
+
+// Copy of the last checked input line (maskLine matches it)
+static char spell_line[INPUTLINE_LENGTH+1];
+static bool spell_line_checked;
 #endif
 
 typedef struct {
@@ -212,10 +326,26 @@ typedef struct {
   char *status, *wildcard;
   ccolor *color;
   GPatternSpec *compiled;
+  guint rank;     // Position in rostercolrules (the first matching rule wins)
 } rostercolor;
 
 static GSList *rostercolrules = NULL;
 
+// Roster color rules, sorted for faster lookups.  Built when needed,
+// and dropped when the rules are modified.
+static struct {
+  gboolean    built;
+  GHashTable *exact;    // JID -> list of rules without wildcards
+  GHashTable *suffix;   // Suffix -> list of "*suffix" rules
+  GSList     *globs;    // Other rules
+  GHashTable *cache;    // JID -> rostercolor_cached
+} rostercolmatch;
+
+typedef struct {
+  char status;
+  rostercolor *rule;    // NULL if there is no matching rule
+} rostercolor_cached;
+
 static GHashTable *muccolors = NULL, *nickcolors = NULL;
 
 typedef struct {
@@ -366,6 +496,133 @@ void scr_muc_nick_color(const char *nick, const char *color)
     scr_update_buddy_window();
 }
 
+static void free_rule_list(gpointer data)
+{
+  g_slist_free(data);
+}
+
+//  rostercolor_reset()
+// Drop the compiled rules and the cached results.
+static void rostercolor_reset(void)
+{
+  // The colors of the displayed rows may change
+  roster_view_reset();
+  update_roster = TRUE;
+
+  if (!rostercolmatch.built)
+    return;
+  g_hash_table_destroy(rostercolmatch.exact);
+  g_hash_table_destroy(rostercolmatch.suffix);
+  g_hash_table_destroy(rostercolmatch.cache);
+  g_slist_free(rostercolmatch.globs);
+  memset(&rostercolmatch, 0, sizeof(rostercolmatch));
+}
+
+//  rostercolor_build()
+// Sort the roster color rules: rules without wildcards are indexed by JID,
+// "*suffix" rules (e.g. "*@domain") by suffix, the others are kept in
+// a list.
+static void rostercolor_build(void)
+{
+  GSList *head;
+  guint rank = 0;
+
+  rostercolmatch.exact  = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                NULL, free_rule_list);
+  rostercolmatch.suffix = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                NULL, free_rule_list);
+  rostercolmatch.cache  = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                g_free, g_free);
+  rostercolmatch.globs  = NULL;
+
+  for (head = rostercolrules; head; head = g_slist_next(head)) {
+    rostercolor *rc = head->data;
+    const char *w = rc->wildcard;
+    GHashTable *table = NULL;
+
+    rc->rank = rank++;
+    if (!strpbrk(w, "*?")) {
+      table = rostercolmatch.exact;
+    } else if (*w == '*' && !strpbrk(w+1, "*?")) {
+      table = rostercolmatch.suffix;
+      w++;
+    }
+    if (table) {
+      // Lists are short, the order does not matter (see rank)
+      GSList *rules = g_hash_table_lookup(table, w);
+      g_hash_table_steal(table, w);
+      g_hash_table_insert(table, (gpointer)w, g_slist_prepend(rules, rc));
+    } else {
+      rostercolmatch.globs = g_slist_prepend(rostercolmatch.globs, rc);
+    }
+  }
+  rostercolmatch.built = TRUE;
+}
+
+static inline gboolean rostercolor_status_match(rostercolor *rc, char status)
+{
+  return (!strcmp("*", rc->status) || strchr(rc->status, status));
+}
+
+// Return the rule of the list with the lowest rank matching the status,
+// if its rank is lower than best's.
+static rostercolor *rostercolor_best(GSList *rules, char status,
+                                     rostercolor *best)
+{
+  for ( ; rules; rules = g_slist_next(rules)) {
+    rostercolor *rc = rules->data;
+    if ((!best || rc->rank < best->rank) &&
+        rostercolor_status_match(rc, status))
+      best = rc;
+  }
+  return best;
+}
+
+//  rostercolor_lookup(jid, status)
+// Return the first roster color rule matching the JID and status,
+// or NULL.  Results are cached until the JID status or the rules change.
+static rostercolor *rostercolor_lookup(const char *jid, char status)
+{
+  rostercolor_cached *cached;
+  rostercolor *best;
+  const char *p;
+  GSList *head;
+
+  if (!rostercolrules || !jid)
+    return NULL;
+
+  if (!rostercolmatch.built)
+    rostercolor_build();
+
+  cached = g_hash_table_lookup(rostercolmatch.cache, jid);
+  if (cached && cached->status == status)
+    return cached->rule;
+
+  best = rostercolor_best(g_hash_table_lookup(rostercolmatch.exact, jid),
+                          status, NULL);
+  for (p = jid; ; p++) {
+    best = rostercolor_best(g_hash_table_lookup(rostercolmatch.suffix, p),
+                            status, best);
+    if (!*p)
+      break;
+  }
+  for (head = rostercolmatch.globs; head; head = g_slist_next(head)) {
+    rostercolor *rc = head->data;
+    if ((!best || rc->rank < best->rank) &&
+        rostercolor_status_match(rc, status) &&
+        g_pattern_match_string(rc->compiled, jid))
+      best = rc;
+  }
+
+  if (!cached) {
+    cached = g_new(rostercolor_cached, 1);
+    g_hash_table_insert(rostercolmatch.cache, g_strdup(jid), cached);
+  }
+  cached->status = status;
+  cached->rule = best;
+  return best;
+}
+
 static void free_rostercolrule(rostercolor *col)
 {
   g_free(col->status);
@@ -379,6 +636,7 @@ static void free_rostercolrule(rostercolor *col)
 void scr_roster_clear_color(void)
 {
   GSList *head;
+  rostercolor_reset();
   for (head = rostercolrules; head; head = g_slist_next(head)) {
     free_rostercolrule(head->data);
   }
@@ -407,6 +665,7 @@ bool scr_roster_color(const char *status, const char *wildcard,
   }
   if (!strcmp(color,"-")) { // Delete the rule
     if (found) {
+      rostercolor_reset();
       free_rostercolrule(found->data);
       rostercolrules = g_slist_delete_link(rostercolrules, found);
       return TRUE;
@@ -420,6 +679,7 @@ bool scr_roster_color(const char *status, const char *wildcard,
       scr_LogPrint(LPRINT_NORMAL, "No such color name");
       return FALSE;
     }
+    rostercolor_reset();
     if (found) {
       rostercolor *rc = found->data;
       g_free(rc->color);
@@ -587,6 +847,7 @@ static void parse_colors(void)
   }
 
   colors_stalled = FALSE;
+  roster_view_reset();
 }
 
 static void init_keycodes(void)
@@ -779,6 +1040,82 @@ gboolean scr_curses_status(void)
   return Curses;
 }
 
+//  scr_set_offscreen()
+// Render the screen into memory instead of the terminal.  This must be
+// called before scr_init_curses().  Keys are still read from stdin, and the
+// screen size can be set with the LINES and COLUMNS environment variables.
+void scr_set_offscreen(void)
+{
+  Offscreen = TRUE;
+}
+
+//  offscreen_count_cells()
+// Compare the screen with the copy of the previous frame and update the
+// offscreen statistics.
+static void offscreen_count_cells(void)
+{
+  int y, x, cury, curx;
+  gulong changed = 0;
+
+  if (offscreen.rows != LINES || offscreen.cols != COLS) {
+    g_free(offscreen.cells);
+    g_free(offscreen.row);
+    offscreen.rows = LINES;
+    offscreen.cols = COLS;
+    offscreen.cells = g_new0(chtype, LINES * COLS);
+    offscreen.row = g_new(chtype, COLS + 1);
+  }
+
+  offscreen.updates++;
+  getyx(curscr, cury, curx);
+  for (y = 0; y < offscreen.rows; y++) {
+    chtype *cell = offscreen.cells + y * offscreen.cols;
+    mvwinchnstr(curscr, y, 0, offscreen.row, offscreen.cols);
+    for (x = 0; x < offscreen.cols; x++) {
+      if (cell[x] != offscreen.row[x]) {
+        cell[x] = offscreen.row[x];
+        changed++;
+      }
+    }
+  }
+  wmove(curscr, cury, curx);
+
+  if (!changed)
+    return;
+  offscreen.frames++;
+  offscreen.changed = changed;
+  offscreen.changed_total += changed;
+  if (changed > offscreen.changed_max)
+    offscreen.changed_max = changed;
+}
+
+//  offscreen_dump()
+// Return the offscreen statistics and the text displayed on the screen.
+// The string should be freed by the caller.
+static GString *offscreen_dump(void)
+{
+  GString *dump = g_string_new(NULL);
+  char *line = g_new(char, 4*COLS + 1);
+  int y, n;
+
+  g_string_append_printf(dump, "Offscreen rendering (%s): %u updates, "
+                         "%u frames, %lu cells changed (max. %lu per frame)\n",
+                         offscreen.termtype, offscreen.updates,
+                         offscreen.frames,
+                         offscreen.changed_total, offscreen.changed_max);
+  for (y = 0; y < LINES; y++) {
+    n = mvwinnstr(curscr, y, 0, line, 4*COLS);
+    if (n < 0)
+      n = 0;
+    while (n > 0 && line[n-1] == ' ')
+      n--;
+    g_string_append_len(dump, line, n);
+    g_string_append_c(dump, '\n');
+  }
+  g_free(line);
+  return dump;
+}
+
 static gchar *scr_color_guard(const gchar *key, const gchar *new_value)
 {
   if (g_strcmp0(settings_opt_get(key), new_value))
@@ -791,7 +1128,32 @@ void scr_init_curses(void)
   /* Key sequences initialization */
   init_keycodes();
 
-  initscr();
+  if (Offscreen) {
+    // The terminal description only matters for the discarded output, so
+    // use the first one available: xterm, then $TERM, then dumb.
+    const char *termtypes[3], *env_term;
+    int i, n = 0;
+
+    termtypes[n++] = "xterm";
+    env_term = getenv("TERM");
+    if (env_term && *env_term &&
+        strcmp(env_term, "xterm") && strcmp(env_term, "dumb"))
+      termtypes[n++] = env_term;
+    termtypes[n++] = "dumb";
+
+    offscreen.out = fopen("/dev/null", "w");
+    for (i = 0; offscreen.out && i < n && !offscreen.term; i++) {
+      offscreen.termtype = termtypes[i];
+      offscreen.term = newterm((char *)termtypes[i], offscreen.out, stdin);
+    }
+    if (!offscreen.term) {
+      fprintf(stderr, "Cannot initialize offscreen rendering "
+              "(no xterm, $TERM or dumb terminal description)!\n");
+      exit(EXIT_FAILURE);
+    }
+  } else {
+    initscr();
+  }
   raw();
   noecho();
   nonl();
@@ -845,11 +1207,26 @@ void scr_init_curses(void)
 
 void scr_terminate_curses(void)
 {
+  GString *dump = NULL;
+
   if (!Curses) return;
+  if (offscreen.term)
+    dump = offscreen_dump();
   clear();
   refresh();
   endwin();
   Curses = FALSE;
+  if (dump) {
+    // The statistics and the last screen go to the real stdout
+    fputs(dump->str, stdout);
+    g_string_free(dump, TRUE);
+    delscreen(offscreen.term);
+    fclose(offscreen.out);
+    offscreen.term = NULL;
+    g_free(offscreen.cells);
+    g_free(offscreen.row);
+    offscreen.cells = offscreen.row = NULL;
+  }
   return;
 }
 
@@ -914,6 +1291,59 @@ guint scr_getlogwinheight(void)
   return 0;
 }
 
+//  log_ring_add(line)
+// Add a line to the log window ring; the line will be displayed with the
+// next frame.  The ring takes ownership of the string.
+static void log_ring_add(gchar *line)
+{
+  guint pos;
+
+  if (log_ring.count < LOG_RING_SIZE) {
+    pos = (log_ring.first + log_ring.count++) % LOG_RING_SIZE;
+  } else {
+    pos = log_ring.first;
+    log_ring.first = (log_ring.first + 1) % LOG_RING_SIZE;
+    g_free(log_ring.lines[pos]);
+  }
+  log_ring.lines[pos] = line;
+  if (log_ring.pending < LOG_RING_SIZE)
+    log_ring.pending++;
+}
+
+//  scr_draw_log_ring()
+// Display the pending lines of the log window ring.  If there are more
+// lines than the window can display, or if the window has been resized,
+// only the last lines are printed.
+static void scr_draw_log_ring(void)
+{
+  guint i, n, height;
+  gboolean redraw;
+
+  if (!log_ring.pending && !log_ring.full)
+    return;
+
+  height = (Log_Win_Height > 2 ? Log_Win_Height - 2 : 1);
+  redraw = log_ring.full || log_ring.pending >= height;
+  if (redraw) {
+    n = MIN(log_ring.count, height);
+    werase(logWnd);
+    wmove(logWnd, 0, 0);
+  } else {
+    n = log_ring.pending;
+  }
+  // The cursor is left at the end of the last line
+  for (i = log_ring.count - n; i < log_ring.count; i++) {
+    const gchar *line = log_ring.lines[(log_ring.first + i) % LOG_RING_SIZE];
+    if (redraw && i == log_ring.count - n)
+      waddstr(logWnd, line);
+    else
+      wprintw(logWnd, "\n%s", line);
+  }
+  log_ring.pending = 0;
+  log_ring.full = FALSE;
+  update_panels();
+}
+
 //  scr_print_logwindow(string)
 // Display the string in the log window.
 // Note: The string must be in the user's locale!
@@ -925,23 +1355,40 @@ void scr_print_logwindow(const char *string)
   timestamp = time(NULL);
   strftime(strtimestamp, 48, "[%H:%M:%S]", localtime(&timestamp));
   if (Curses) {
-    wprintw(logWnd, "\n%s %s", strtimestamp, string);
-    update_panels();
+    log_ring_add(g_strdup_printf("%s %s", strtimestamp, string));
   } else {
     printf("%s %s\n", strtimestamp, string);
   }
 }
 
+//  log_to_status_buffer(flag)
+// Tell if a message printed with these flags should be copied to the
+// status buffer, depending on the "log_status_buffer" option:
+// 0: never, 1: unless the message is also written to the tracelog,
+// 2 (default): always.
+static gboolean log_to_status_buffer(unsigned int flag)
+{
+  const char *level = settings_opt_get("log_status_buffer");
+  int n = level ? atoi(level) : 2;
+
+  if (n >= 2)
+    return TRUE;
+  if (n == 1)
+    return !(flag & (LPRINT_LOG|LPRINT_DEBUG));
+  return FALSE;
+}
+
 //  scr_log_print(...)
 // Display a message in the log window and in the status buffer.
 // Add the message to the tracelog file if the log flag is set.
 // This function will convert from UTF-8 unless the LPRINT_NOTUTF8 flag is set.
+// In curses mode the log window is only updated with the next frame.
 void scr_log_print(unsigned int flag, const char *fmt, ...)
 {
   time_t timestamp;
   char strtimestamp[64];
   char *buffer, *btext;
-  char *convbuf1 = NULL, *convbuf2 = NULL;
+  char *convbuf2 = NULL;
   va_list ap;
 
   if (!(flag & ~LPRINT_NOTUTF8)) return; // Shouldn't happen
@@ -958,42 +1405,53 @@ void scr_log_print(unsigned int flag, const char *fmt, ...)
 
     buffer = g_strdup_printf("%s %s", strtimestamp, btext);
 
-    // Convert buffer to current locale for wprintw()
+    // Convert buffer to current locale for the log window
     if (!(flag & LPRINT_NOTUTF8))
-      buffer_locale = convbuf1 = from_utf8(buffer);
+      buffer_locale = from_utf8_ref(buffer);
     else
       buffer_locale = buffer;
 
     if (!buffer_locale) {
-      wprintw(logWnd,
-              "\n%s*Error: cannot convert string to locale.", strtimestamp);
-      update_panels();
       g_free(buffer);
+      buffer = g_strdup_printf("%s*Error: cannot convert string to locale.",
+                               strtimestamp);
+      if (Curses)
+        log_ring_add(buffer);
+      else
+        g_free(buffer);
       g_free(btext);
       return;
     }
 
     // For the special status buffer, we need utf-8, but without the timestamp
-    if (flag & LPRINT_NOTUTF8)
-      buf_specialwindow = convbuf2 = to_utf8(btext);
+    if (!log_to_status_buffer(flag))
+      buf_specialwindow = NULL;
+    else if (flag & LPRINT_NOTUTF8)
+      buf_specialwindow = convbuf2 = to_utf8_ref(btext);
     else
       buf_specialwindow = btext;
 
     if (Curses) {
-      wprintw(logWnd, "\n%s", buffer_locale);
-      update_panels();
-      scr_write_in_window(NULL, buf_specialwindow, timestamp,
-                          HBB_PREFIX_SPECIAL, FALSE, 0, NULL);
+      if (buf_specialwindow)
+        scr_write_in_window(NULL, buf_specialwindow, timestamp,
+                            HBB_PREFIX_SPECIAL, FALSE, 0, NULL);
+      // The ring takes the line
+      if (buffer_locale != buffer)
+        g_free(buffer);
+      log_ring_add(buffer_locale);
     } else {
       printf("%s\n", buffer_locale);
       // ncurses are not initialized yet, so we call directly hbuf routine
-      hbuf_add_line(&statushbuf, buf_specialwindow, timestamp,
-        HBB_PREFIX_SPECIAL, 0, 0, 0, NULL);
+      if (buf_specialwindow)
+        hbuf_add_line(&statushbuf, buf_specialwindow, timestamp,
+                      HBB_PREFIX_SPECIAL, 0, 0, 0, NULL);
+      if (buffer_locale != buffer)
+        g_free(buffer_locale);
+      g_free(buffer);
     }
 
-    g_free(convbuf1);
-    g_free(convbuf2);
-    g_free(buffer);
+    if (convbuf2 != btext)
+      g_free(convbuf2);
   }
 
   if (flag & (LPRINT_LOG|LPRINT_DEBUG)) {
@@ -1152,25 +1610,222 @@ size_t scr_line_prefix(hbb_line *line, char *pref, guint preflen)
   return timepreflen;
 }
 
+//  get_muc_coltype()
+// Return the nick coloring mode of the current buddy.
+static muccoltype get_muc_coltype(void)
+{
+  muccoltype type = glob_muccol;
+
+  if (muccolors && current_buddy) {
+    muccoltype *typetmp;
+    char *mucjid = g_utf8_strdown(CURRENT_JID, -1);
+    typetmp = g_hash_table_lookup(muccolors, mucjid);
+    if (typetmp)
+      type = *typetmp;
+    g_free(mucjid);
+  }
+  return type;
+}
+
+//  scr_line_prefix_memo(node, line, pref, preflen)
+// Same as scr_line_prefix(), but the prefix of the hbuf element node is
+// only formatted once.  (The memos are dropped when time_prefix changes.)
+static size_t scr_line_prefix_memo(GList *node, hbb_line *line, char *pref,
+                                   guint preflen)
+{
+  const char *memo;
+  size_t timelen = 0;
+
+  // Continuation lines have a blank prefix
+  if (line->flags & HBB_PREFIX_CONT)
+    return scr_line_prefix(line, pref, preflen);
+
+  memo = hbuf_get_prefix_memo(node, &timelen);
+  if (memo) {
+    g_strlcpy(pref, memo, preflen);
+    return timelen;
+  }
+  timelen = scr_line_prefix(line, pref, preflen);
+  hbuf_set_prefix_memo(node, pref, timelen);
+  return timelen;
+}
+
+//  scr_draw_chat_line(win_entry, winy, node, line, prefixwidth, type)
+// Display a buffer line (prefix and text) at row winy of the chat window.
+// node is the hbuf element of the line.
+// The cursor must be at the beginning of the row.
+// type is the nick coloring mode of the room (see get_muc_coltype()).
+static void scr_draw_chat_line(winbuf *win_entry, int winy, GList *node,
+                               hbb_line *line, guint prefixwidth,
+                               muccoltype type)
+{
+  char pref[96];
+  int color;
+  int timelen;
+
+  if (line->flags & HBB_PREFIX_HLIGHT_OUT)
+    color = COLOR_MSGOUT;
+  else if (line->flags & HBB_PREFIX_HLIGHT)
+    color = COLOR_MSGHL;
+  else if (line->flags & HBB_PREFIX_INFO)
+    color = COLOR_INFO;
+  else if (line->flags & HBB_PREFIX_IN)
+    color = COLOR_MSGIN;
+  else
+    color = COLOR_GENERAL;
+
+  if (color != COLOR_GENERAL)
+    wattrset(win_entry->win, get_color(color));
+
+  // Generate the prefix area and display it
+
+  timelen = scr_line_prefix_memo(node, line, pref, prefixwidth);
+  if (timelen && line->flags & HBB_PREFIX_DELAYED) {
+    char tmp;
+
+    tmp = pref[timelen];
+    pref[timelen] = '\0';
+    wattrset(win_entry->win, get_color(COLOR_TIMESTAMP));
+    wprintw(win_entry->win, pref);
+    pref[timelen] = tmp;
+    wattrset(win_entry->win, get_color(color));
+    wprintw(win_entry->win, pref+timelen);
+  } else
+    wprintw(win_entry->win, pref);
+
+  // Make sure we are at the right position
+  wmove(win_entry->win, winy, prefixwidth-1);
+
+  // The MUC nick - overwrite with proper color
+  if (line->mucnicklen) {
+    char tmp;
+    nickcolor *actual = NULL;
+    ccolor *nickcol = NULL;
+
+    // Store the char after the nick
+    tmp = line->text[line->mucnicklen];
+    // Terminate the string after the nick
+    line->text[line->mucnicklen] = '\0';
+    // Colors set with "/color mucnick" take precedence
+    if (nickcolors)
+      actual = g_hash_table_lookup(nickcolors, line->text);
+    if (actual && ((type == MC_ALL) || (actual->manual)))
+      nickcol = actual->color;
+    else if (type == MC_ALL && nickcolcount)
+      nickcol = nickcols[line->mucnickhash % nickcolcount];
+    if (nickcol && (line->flags & HBB_PREFIX_IN) &&
+        (!(line->flags & HBB_PREFIX_HLIGHT_OUT)))
+      wattrset(win_entry->win, compose_color(nickcol));
+    wprintw(win_entry->win, "%s", line->text);
+    // Return the char
+    line->text[line->mucnicklen] = tmp;
+    // Return the color back
+    wattrset(win_entry->win, get_color(color));
+  }
+
+  // Display text line
+  wprintw(win_entry->win, "%s", line->text+line->mucnicklen);
+  wclrtoeol(win_entry->win);
+
+  // Restore default ("general") color
+  if (color != COLOR_GENERAL)
+    wattrset(win_entry->win, get_color(COLOR_GENERAL));
+}
+
+//  scr_append_window(win_entry)
+// Try to display the lines added to the chat window buffer since the last
+// full repaint, by scrolling the window and drawing the new lines only.
+// Returns FALSE if a full repaint is needed.
+static gboolean scr_append_window(winbuf *win_entry, guint prefixwidth)
+{
+  GList *node;
+  hbb_line **lines, *line;
+  int n, nnew, scroll;
+
+  if (chat_painted.win != win_entry || !chat_painted.last ||
+      chat_painted.readmark || chat_painted.prefixwidth != prefixwidth ||
+      chat_painted.height != CHAT_WIN_HEIGHT ||
+      win_entry->bd->cleared || win_entry->bd->lock || win_entry->bd->top)
+    return FALSE;
+
+  // Count the new lines
+  nnew = 0;
+  for (node = g_list_next(chat_painted.last); node; node = g_list_next(node))
+    if (++nnew >= CHAT_WIN_HEIGHT)
+      return FALSE;
+  if (!nnew)
+    return TRUE;
+
+  // Get the last displayed line and the new ones
+  lines = hbuf_get_lines(chat_painted.last, nnew+1);
+
+  // If a readmark has been set, it will have to be displayed
+  for (n = 0; n < nnew; n++) {
+    line = lines[n];
+    if (line && (line->flags & HBB_PREFIX_READMARK))
+      break;
+  }
+
+  if (n == nnew) {
+    muccoltype type = get_muc_coltype();
+    scroll = chat_painted.rows + nnew - CHAT_WIN_HEIGHT;
+    if (scroll > 0) {
+      scrollok(win_entry->win, TRUE);
+      wscrl(win_entry->win, scroll);
+      scrollok(win_entry->win, FALSE);
+      chat_painted.rows -= scroll;
+    }
+    for (n = 1; n <= nnew && lines[n]; n++) {
+      chat_painted.last = g_list_next(chat_painted.last);
+      wmove(win_entry->win, chat_painted.rows, 0);
+      scr_draw_chat_line(win_entry, chat_painted.rows, chat_painted.last,
+                         lines[n], prefixwidth, type);
+      chat_painted.rows++;
+    }
+  }
+
+  for (n = 0; n <= nnew; n++) {
+    line = lines[n];
+    if (line) {
+      g_free(line->text);
+      g_free(line);
+    }
+  }
+  g_free(lines);
+  return (chat_painted.last && !g_list_next(chat_painted.last));
+}
+
 //  scr_update_window()
 // (Re-)Display the given chat window.
-static void scr_update_window(winbuf *win_entry)
+// If the window is being displayed and has only received new lines,
+// they are appended (see scr_append_window()), unless full is TRUE.
+static void scr_update_window(winbuf *win_entry, int full)
 {
   int n, mark_offset = 0;
   guint prefixwidth;
   char pref[96];
   hbb_line **lines, *line;
-  GList *hbuf_head;
+  GList *hbuf_head, *node;
+  GList *last_node = NULL;
+  int rows = 0;
   int color = COLOR_GENERAL;
+  muccoltype type;
   bool readmark = FALSE;
   bool skipline = FALSE;
   int autolock;
 
   autolock = settings_opt_get_int("buffer_smart_scrolling");
 
+  if (win_entry == currentWindow)
+    update_chat = FALSE;
+
   prefixwidth = scr_getprefixwidth();
   prefixwidth = MIN(prefixwidth, sizeof pref);
 
+  if (!full && scr_append_window(win_entry, prefixwidth))
+    return;
+  chat_painted.win = NULL;
+
   // Should the window be empty?
   if (win_entry->bd->cleared) {
     werase(win_entry->win);
@@ -1226,106 +1881,19 @@ static void scr_update_window(winbuf *win_entry)
   }
 
   // Display the lines
-  for (n = 0 ; n < CHAT_WIN_HEIGHT; n++) {
-    int timelen;
+  type = get_muc_coltype();
+  node = hbuf_head;
+  for (n = 0 ; n < CHAT_WIN_HEIGHT; n++, node = g_list_next(node)) {
     int winy = n + mark_offset;
     wmove(win_entry->win, winy, 0);
     line = *(lines+n);
     if (line) {
+      last_node = node;
+      rows = winy + 1;
       if (skipline)
         goto scr_update_window_skipline;
 
-      if (line->flags & HBB_PREFIX_HLIGHT_OUT)
-        color = COLOR_MSGOUT;
-      else if (line->flags & HBB_PREFIX_HLIGHT)
-        color = COLOR_MSGHL;
-      else if (line->flags & HBB_PREFIX_INFO)
-        color = COLOR_INFO;
-      else if (line->flags & HBB_PREFIX_IN)
-        color = COLOR_MSGIN;
-      else
-        color = COLOR_GENERAL;
-
-      if (color != COLOR_GENERAL)
-        wattrset(win_entry->win, get_color(color));
-
-      // Generate the prefix area and display it
-
-      timelen = scr_line_prefix(line, pref, prefixwidth);
-      if (timelen && line->flags & HBB_PREFIX_DELAYED) {
-        char tmp;
-
-        tmp = pref[timelen];
-        pref[timelen] = '\0';
-        wattrset(win_entry->win, get_color(COLOR_TIMESTAMP));
-        wprintw(win_entry->win, pref);
-        pref[timelen] = tmp;
-        wattrset(win_entry->win, get_color(color));
-        wprintw(win_entry->win, pref+timelen);
-      } else
-        wprintw(win_entry->win, pref);
-
-      // Make sure we are at the right position
-      wmove(win_entry->win, winy, prefixwidth-1);
-
-      // The MUC nick - overwrite with proper color
-      if (line->mucnicklen) {
-        char *mucjid;
-        char tmp;
-        nickcolor *actual = NULL;
-        muccoltype type, *typetmp;
-
-        // Store the char after the nick
-        tmp = line->text[line->mucnicklen];
-        type = glob_muccol;
-        // Terminate the string after the nick
-        line->text[line->mucnicklen] = '\0';
-        mucjid = g_utf8_strdown(CURRENT_JID, -1);
-        if (muccolors) {
-          typetmp = g_hash_table_lookup(muccolors, mucjid);
-          if (typetmp)
-            type = *typetmp;
-        }
-        g_free(mucjid);
-        // Need to generate a color for the specified nick?
-        if ((type == MC_ALL) && (!nickcolors ||
-            !g_hash_table_lookup(nickcolors, line->text))) {
-          char *snick, *mnick;
-          nickcolor *nc;
-          const char *p = line->text;
-          unsigned int nicksum = 0;
-          snick = g_strdup(line->text);
-          mnick = g_strdup(line->text);
-          nc = g_new(nickcolor, 1);
-          ensure_string_htable(&nickcolors, NULL);
-          while (*p)
-            nicksum += *p++;
-          nc->color = nickcols[nicksum % nickcolcount];
-          nc->manual = FALSE;
-          *snick = '<';
-          snick[strlen(snick)-1] = '>';
-          *mnick = '*';
-          mnick[strlen(mnick)-1] = ' ';
-          // Insert them
-          g_hash_table_insert(nickcolors, snick, nc);
-          g_hash_table_insert(nickcolors, mnick, nc);
-        }
-        if (nickcolors)
-          actual = g_hash_table_lookup(nickcolors, line->text);
-        if (actual && ((type == MC_ALL) || (actual->manual))
-            && (line->flags & HBB_PREFIX_IN) &&
-           (!(line->flags & HBB_PREFIX_HLIGHT_OUT)))
-          wattrset(win_entry->win, compose_color(actual->color));
-        wprintw(win_entry->win, "%s", line->text);
-        // Return the char
-        line->text[line->mucnicklen] = tmp;
-        // Return the color back
-        wattrset(win_entry->win, get_color(color));
-      }
-
-      // Display text line
-      wprintw(win_entry->win, "%s", line->text+line->mucnicklen);
-      wclrtoeol(win_entry->win);
+      scr_draw_chat_line(win_entry, winy, node, line, prefixwidth, type);
 
 scr_update_window_skipline:
       skipline = FALSE;
@@ -1347,10 +1915,6 @@ scr_update_window_skipline:
         wattrset(win_entry->win, get_color(COLOR_GENERAL));
       }
 
-      // Restore default ("general") color
-      if (color != COLOR_GENERAL)
-        wattrset(win_entry->win, get_color(COLOR_GENERAL));
-
       g_free(line->text);
       g_free(line);
     } else {
@@ -1371,6 +1935,16 @@ scr_update_window_skipline:
     scr_buffer_scroll_lock(0);
   }
 
+  // Remember what is displayed, so that new lines can be appended
+  if (!line && !win_entry->bd->lock && !win_entry->bd->top) {
+    chat_painted.win = win_entry;
+    chat_painted.last = last_node;
+    chat_painted.rows = rows;
+    chat_painted.readmark = readmark;
+    chat_painted.prefixwidth = prefixwidth;
+    chat_painted.height = CHAT_WIN_HEIGHT;
+  }
+
   g_free(lines);
 }
 
@@ -1410,7 +1984,7 @@ static void scr_show_window(const char *winId, int special)
   update_roster = TRUE;
 
   // Refresh the window
-  scr_update_window(win_entry);
+  scr_update_window(win_entry, TRUE);
 
   // Finished :)
   update_panels();
@@ -1504,11 +2078,12 @@ static void scr_write_in_window(const char *winId, const char *text,
   else
     num_history_blocks = get_max_history_blocks();
 
-  text_locale = from_utf8(text);
+  text_locale = from_utf8_ref(text);
   // Convert the nick alone and compute its length
-  if (mucnicklen) {
+  // (the length does not change when the locale is UTF-8)
+  if (mucnicklen && !utf8_mode) {
     nicktmp = g_strndup(text, mucnicklen);
-    nicklocaltmp = from_utf8(nicktmp);
+    nicklocaltmp = from_utf8_ref(nicktmp);
     if (nicklocaltmp)
       mucnicklen = strlen(nicklocaltmp);
     g_free(nicklocaltmp);
@@ -1517,7 +2092,11 @@ static void scr_write_in_window(const char *winId, const char *text,
   hbuf_add_line(&win_entry->bd->hbuf, text_locale, timestamp, prefix_flags,
                 maxX - Roster_Width - scr_getprefixwidth(), num_history_blocks,
                 mucnicklen, xep184);
-  g_free(text_locale);
+  // Old blocks may have been freed, including the last painted line
+  if (num_history_blocks && chat_painted.win == win_entry)
+    chat_painted.win = NULL;
+  if (text_locale != text)
+    g_free(text_locale);
 
   if (win_entry->bd->cleared) {
     win_entry->bd->cleared = FALSE;
@@ -1543,10 +2122,15 @@ static void scr_write_in_window(const char *winId, const char *text,
       if (!special && (prefix_flags & (HBB_PREFIX_OUT|HBB_PREFIX_HLIGHT_OUT)))
         hbuf_set_readmark(win_entry->bd->hbuf, FALSE);
     // Show and refresh the window
-    top_panel(win_entry->panel);
-    scr_update_window(win_entry);
-    top_panel(inputPanel);
-    update_panels();
+    // The current window will be repainted with the next frame.
+    if (win_entry == currentWindow) {
+      update_chat = TRUE;
+    } else {
+      top_panel(win_entry->panel);
+      scr_update_window(win_entry, FALSE);
+      top_panel(inputPanel);
+      update_panels();
+    }
   } else if (settings_opt_get_int("clear_unread_on_carbon") &&
              prefix_flags & HBB_PREFIX_OUT &&
              prefix_flags & HBB_PREFIX_CARBON) {
@@ -1585,11 +2169,28 @@ static char *attention_sign_guard(const gchar *key, const gchar *new_value)
   return g_strdup(new_value);
 }
 
+static void clear_prefix_memo(gpointer key, gpointer value, gpointer data)
+{
+  winbuf *win_entry = value;
+  hbuf_clear_prefix_memo(win_entry->bd->hbuf);
+}
+
+static char *time_prefix_guard(const gchar *key, const gchar *new_value)
+{
+  // Formatted line prefixes must be rebuilt
+  if (winbufhash)
+    g_hash_table_foreach(winbufhash, clear_prefix_memo, NULL);
+  hbuf_clear_prefix_memo(statushbuf);
+  chat_painted.win = NULL;
+  return g_strdup(new_value);
+}
+
 //  scr_init_settings()
 // Create guards for UI settings
 void scr_init_settings(void)
 {
   settings_set_guard("attention_char", attention_sign_guard);
+  settings_set_guard("time_prefix", time_prefix_guard);
 }
 
 static unsigned int attention_sign(void)
@@ -1606,8 +2207,10 @@ static unsigned int attention_sign(void)
 // if you call top_panel()/update_panels() later.
 void scr_update_main_status(int forceupdate)
 {
-  char *sm = from_utf8(xmpp_getstatusmsg());
+  const char *statusmsg = xmpp_getstatusmsg();
+  char *sm = from_utf8_ref(statusmsg);
   const char *info = settings_opt_get("info");
+  const char *state = xmpp_reconnect_status();
   guint prio = 0;
   gpointer unread_ptr;
   guint unreadchar;
@@ -1631,19 +2234,30 @@ void scr_update_main_status(int forceupdate)
 
   werase(mainstatusWnd);
   if (info) {
-    char *info_locale = from_utf8(info);
+    char *info_locale = from_utf8_ref(info);
     mvwprintw(mainstatusWnd, 0, 0, "%lc[%c] %s %s", unreadchar,
               imstatus2char[xmpp_getstatus()],
               info_locale, (sm ? sm : ""));
-    g_free(info_locale);
+    if (info_locale != info)
+      g_free(info_locale);
   } else
     mvwprintw(mainstatusWnd, 0, 0, "%lc[%c] %s", unreadchar,
               imstatus2char[xmpp_getstatus()], (sm ? sm : ""));
+  if (!state)
+    state = sendq_status();
+  if (state) {
+    // Right-aligned connection state
+    int maxx = getmaxx(mainstatusWnd);
+    int len = strlen(state) + 2;
+    if (maxx > len + 8)
+      mvwprintw(mainstatusWnd, 0, maxx - len - 1, "(%s)", state);
+  }
   if (forceupdate) {
     top_panel(inputPanel);
     update_panels();
   }
-  g_free(sm);
+  if (sm != statusmsg)
+    g_free(sm);
 }
 
 //  scr_draw_main_window()
@@ -1659,6 +2273,7 @@ void scr_draw_main_window(unsigned int fullinit)
   int chat_y_pos, chatstatus_y_pos, log_y_pos;
   int roster_x_pos, chat_x_pos;
 
+  roster_view_reset();
   roster_no_leading_space = settings_opt_get_int("roster_no_leading_space");
 
   Log_Win_Height = DEFAULT_LOG_WIN_HEIGHT;
@@ -1775,6 +2390,10 @@ void scr_draw_main_window(unsigned int fullinit)
 
   // Auto-scrolling in log window
   scrollok(logWnd, TRUE);
+  // The input line has to be printed again
+  inputline_shown.valid = FALSE;
+  // The log window is refilled from the ring with the next frame
+  log_ring.full = TRUE;
 
 
   if (fullinit) {
@@ -1885,6 +2504,7 @@ void scr_resize(void)
     dim.c = 1;
 
   // Resize all buffers
+  chat_painted.win = NULL;
   g_hash_table_foreach(winbufhash, resize_win_buffer, &dim);
 
   // Resize/move special status buffer
@@ -1909,6 +2529,26 @@ void sigwinch_resize(void)
 }
 #endif
 
+// buddy_foreach_resource() callback: remember the resource name
+static void store_resource_name(gpointer rosterdata, const char *resname,
+                                void *param)
+{
+  *(const char **)param = resname;
+}
+
+// buddy_foreach_resource() callback: update the chatstate indicator
+static void update_pending_char(gpointer rosterdata, const char *resname,
+                                void *param)
+{
+  guint *pending = param;
+  guint events = buddy_resource_getevents(rosterdata, resname);
+
+  if ((events & ROSTER_EVENT_PAUSED) && *pending != '+')
+    *pending = '.';
+  if (events & ROSTER_EVENT_COMPOSING)
+    *pending = '+';
+}
+
 //  scr_update_chat_status(forceupdate)
 // Redraw the buddy status bar.
 // Set forceupdate to TRUE if update_panels() must be called.
@@ -1974,9 +2614,10 @@ void scr_update_chat_status(int forceupdate)
   }
 
   if (isgrp || isspe) {
-    buf_locale = from_utf8(fullname);
+    buf_locale = from_utf8_ref(fullname);
     mvwprintw(chatstatusWnd, 0, 5, "%s: %s", btypetext, buf_locale);
-    g_free(buf_locale);
+    if (buf_locale != fullname)
+      g_free(buf_locale);
     if (forceupdate) {
       update_panels();
     }
@@ -2006,17 +2647,12 @@ void scr_update_chat_status(int forceupdate)
       fullname = fullnameres;
       msg = buddy_getstatusmsg(BUDDATA(current_buddy), activeres);
     } else {
-      GSList *resources, *p_res, *p_next_res;
-      resources = buddy_getresources(BUDDATA(current_buddy));
-
-      for (p_res = resources ; p_res ; p_res = p_next_res) {
-        p_next_res = g_slist_next(p_res);
-        // Store the status message of the latest resource (highest priority)
-        if (!p_next_res)
-          msg = buddy_getstatusmsg(BUDDATA(current_buddy), p_res->data);
-        g_free(p_res->data);
-      }
-      g_slist_free(resources);
+      const char *lastres = NULL;
+      // Use the status message of the latest resource (highest priority)
+      buddy_foreach_resource(BUDDATA(current_buddy), store_resource_name,
+                             &lastres);
+      if (lastres)
+        msg = buddy_getstatusmsg(BUDDATA(current_buddy), lastres);
     }
   } else {
     msg = buddy_gettopic(BUDDATA(current_buddy));
@@ -2027,10 +2663,11 @@ void scr_update_chat_status(int forceupdate)
   else
     buf = g_strdup_printf("[%c] %s: %s", status, btypetext, fullname);
   replace_nl_with_dots(buf);
-  buf_locale = from_utf8(buf);
+  buf_locale = from_utf8_ref(buf);
   mvwprintw(chatstatusWnd, 0, 1, "%s", buf_locale);
   g_free(fullnameres);
-  g_free(buf_locale);
+  if (buf_locale != buf)
+    g_free(buf_locale);
   g_free(buf);
 
   // Display chatstates of the contact, if available.
@@ -2063,13 +2700,6 @@ void scr_update_chat_status(int forceupdate)
   }
 }
 
-void increment_if_buddy_not_filtered(gpointer rosterdata, void *param)
-{
-  int *p = param;
-  if (buddylist_is_status_filtered(buddy_getstatus(rosterdata, NULL)))
-    *p=*p+1;
-}
-
 //  scr_draw_roster()
 // Display the buddylist (not really the roster) on the screen
 void scr_draw_roster(void)
@@ -2079,13 +2709,14 @@ void scr_draw_roster(void)
   int maxx, maxy;
   GList *buddy;
   int i, n;
-  int rOffset;
   int cursor_backup;
   guint status, pending;
   enum imstatus currentstatus = xmpp_getstatus();
   int x_pos;
   int prefix_length;
   char space[2] = " ";
+  int len, pos;
+  guint serial;
 
   // We can reset update_roster
   update_roster = FALSE;
@@ -2093,6 +2724,11 @@ void scr_draw_roster(void)
   getmaxyx(rosterWnd, maxy, maxx);
   maxx--;  // Last char is for vertical border
 
+  if (roster_win_on_right)
+    x_pos = 1; // 1 char offset (vertical line)
+  else
+    x_pos = 0;
+
   cursor_backup = curs_set(0);
 
   if (!buddylist)
@@ -2100,47 +2736,95 @@ void scr_draw_roster(void)
   else
     scr_update_chat_status(FALSE);
 
-  // Cleanup of roster window
-  werase(rosterWnd);
+  // Full repaint if the geometry has changed, or if the roster is empty.
+  // The status characters and the group counters depend on our status
+  // and on the display filter too.
+  if (!roster_view.rows || roster_view.height != maxy ||
+      roster_view.width != maxx || roster_view.x_pos != x_pos ||
+      roster_view.offline != (currentstatus == offline) ||
+      roster_view.filter != buddylist_get_filter() ||
+      !buddylist || !Roster_Width) {
+    roster_view_reset();
+
+    // Cleanup of roster window
+    werase(rosterWnd);
+
+    if (Roster_Width) {
+      int line_x_pos = roster_win_on_right ? 0 : Roster_Width-1;
+      // Redraw the vertical line (not very good...)
+      wattrset(rosterWnd, get_color(COLOR_GENERAL));
+      for (i=0 ; i < CHAT_WIN_HEIGHT ; i++)
+        mvwaddch(rosterWnd, i, line_x_pos, ACS_VLINE);
+    }
 
-  if (Roster_Width) {
-    int line_x_pos = roster_win_on_right ? 0 : Roster_Width-1;
-    // Redraw the vertical line (not very good...)
-    wattrset(rosterWnd, get_color(COLOR_GENERAL));
-    for (i=0 ; i < CHAT_WIN_HEIGHT ; i++)
-      mvwaddch(rosterWnd, i, line_x_pos, ACS_VLINE);
-  }
+    // Leave now if buddylist is empty or the roster is hidden
+    if (!buddylist || !Roster_Width) {
+      update_panels();
+      curs_set(cursor_backup);
+      return;
+    }
 
-  // Leave now if buddylist is empty or the roster is hidden
-  if (!buddylist || !Roster_Width) {
-    update_panels();
-    curs_set(cursor_backup);
-    return;
+    roster_view.rows = g_new0(roster_row, maxy);
+    roster_view.height = maxy;
+    roster_view.width = maxx;
+    roster_view.x_pos = x_pos;
+    roster_view.offline = (currentstatus == offline);
+    roster_view.filter = buddylist_get_filter();
+  }
+
+  // Find the position of current_buddy.  When the buddylist hasn't been
+  // rebuilt, the cursor has usually not moved or moved by one item.
+  serial = buddylist_get_serial();
+  if (roster_view.cursor && roster_view.serial == serial) {
+    if (current_buddy == roster_view.cursor)
+      pos = roster_view.cursor_pos;
+    else if (current_buddy == g_list_next(roster_view.cursor))
+      pos = roster_view.cursor_pos + 1;
+    else if (current_buddy == g_list_previous(roster_view.cursor))
+      pos = roster_view.cursor_pos - 1;
+    else
+      pos = g_list_position(buddylist, current_buddy);
+  } else {
+    roster_view.top = NULL;
+    pos = g_list_position(buddylist, current_buddy);
   }
 
   // Update offset if necessary
   // a) Try to show as many buddylist items as possible
-  i = g_list_length(buddylist) - maxy;
+  len = buddylist_get_length();
+  i = len - maxy;
   if (i < 0)
     i = 0;
   if (i < offset)
     offset = i;
   // b) Make sure the current_buddy is visible
-  i = g_list_position(buddylist, current_buddy);
-  if (i == -1) { // This is bad
+  if (pos == -1) { // This is bad
     scr_LogPrint(LPRINT_NORMAL, "Doh! Can't find current selected buddy!!");
+    roster_view.cursor = NULL;
     curs_set(cursor_backup);
     return;
-  } else if (i < offset) {
-    offset = i;
-  } else if (i+1 > offset + maxy) {
-    offset = i + 1 - maxy;
+  } else if (pos < offset) {
+    offset = pos;
+  } else if (pos+1 > offset + maxy) {
+    offset = pos + 1 - maxy;
+  }
+
+  // Jump to the first visible item
+  buddy = roster_view.top;
+  if (buddy && abs(offset - roster_view.offset) < maxy) {
+    for (n = roster_view.offset; n < offset; n++)
+      buddy = g_list_next(buddy);
+    for (n = roster_view.offset; n > offset; n--)
+      buddy = g_list_previous(buddy);
+  } else {
+    buddy = g_list_nth(buddylist, offset);
   }
 
-  if (roster_win_on_right)
-    x_pos = 1; // 1 char offset (vertical line)
-  else
-    x_pos = 0;
+  roster_view.serial = serial;
+  roster_view.top = buddy;
+  roster_view.offset = offset;
+  roster_view.cursor = current_buddy;
+  roster_view.cursor_pos = pos;
 
   if (roster_no_leading_space) {
     space[0] = '\0';
@@ -2152,140 +2836,148 @@ void scr_draw_roster(void)
   name = g_new0(char, 4*Roster_Width);
   rline = g_new0(char, 4*Roster_Width+1);
 
-  buddy = buddylist;
-  rOffset = offset;
-
-  for (i=0; i<maxy && buddy; buddy = g_list_next(buddy)) {
+  for (i=0; i<maxy; i++) {
     unsigned short bflags, btype;
     unsigned short ismsg, isgrp, ismuc, ishid, isspe;
     guint isurg;
-    gchar *rline_locale;
-    GSList *resources, *p_res;
+    gchar *rline_locale = NULL;
+    roster_row *row = &roster_view.rows[i];
+    gpointer bdata = buddy ? BUDDATA(buddy) : NULL;
+    guint bserial = bdata ? buddy_getserial(bdata) : 0;
+    bool selected = (buddy && buddy == current_buddy);
+    int attr = 0;
+
+    // Skip the row if it already displays this version of the item
+    if (bdata == row->buddy && bserial == row->serial &&
+        selected == row->selected) {
+      if (buddy)
+        buddy = g_list_next(buddy);
+      continue;
+    }
 
-    bflags = buddy_getflags(BUDDATA(buddy));
-    btype = buddy_gettype(BUDDATA(buddy));
+    if (buddy) {
+      bflags = buddy_getflags(BUDDATA(buddy));
+      btype = buddy_gettype(BUDDATA(buddy));
 
-    ismsg = bflags & ROSTER_FLAG_MSG;
-    ishid = bflags & ROSTER_FLAG_HIDE;
-    isgrp = btype  & ROSTER_TYPE_GROUP;
-    ismuc = btype  & ROSTER_TYPE_ROOM;
-    isspe = btype  & ROSTER_TYPE_SPECIAL;
-    isurg = buddy_getuiprio(BUDDATA(buddy));
+      ismsg = bflags & ROSTER_FLAG_MSG;
+      ishid = bflags & ROSTER_FLAG_HIDE;
+      isgrp = btype  & ROSTER_TYPE_GROUP;
+      ismuc = btype  & ROSTER_TYPE_ROOM;
+      isspe = btype  & ROSTER_TYPE_SPECIAL;
+      isurg = buddy_getuiprio(BUDDATA(buddy));
 
-    if (rOffset > 0) {
-      rOffset--;
-      continue;
-    }
+      status = '?';
+      pending = ' ';
 
-    status = '?';
-    pending = ' ';
-
-    resources = buddy_getresources(BUDDATA(buddy));
-    for (p_res = resources ; p_res ; p_res = g_slist_next(p_res)) {
-      guint events = buddy_resource_getevents(BUDDATA(buddy),
-                                              p_res ? p_res->data : "");
-      if ((events & ROSTER_EVENT_PAUSED) && pending != '+')
-        pending = '.';
-      if (events & ROSTER_EVENT_COMPOSING)
-        pending = '+';
-      g_free(p_res->data);
-    }
-    g_slist_free(resources);
+      buddy_foreach_resource(BUDDATA(buddy), update_pending_char, &pending);
 
-    // Display message notice if there is a message flag, but not
-    // for unfolded groups.
-    if (ismsg && (!isgrp || ishid)) {
-      pending = '#';
-    }
+      // Display message notice if there is a message flag, but not
+      // for unfolded groups.
+      if (ismsg && (!isgrp || ishid)) {
+        pending = '#';
+      }
 
-    if (ismuc) {
-      if (buddy_getinsideroom(BUDDATA(buddy)))
-        status = 'C';
-      else
-        status = 'x';
-    } else if (currentstatus != offline) {
-      enum imstatus budstate;
-      budstate = buddy_getstatus(BUDDATA(buddy), NULL);
-      if (budstate < imstatus_size)
-        status = imstatus2char[budstate];
-    }
-    if (buddy == current_buddy) {
-      if (pending == '#')
-        wattrset(rosterWnd, get_color(COLOR_ROSTERSELNMSG));
-      else
-        wattrset(rosterWnd, get_color(COLOR_ROSTERSEL));
-      // The 3 following lines aim at coloring the whole line
-      wmove(rosterWnd, i, x_pos);
-      for (n = 0; n < maxx; n++)
-        waddch(rosterWnd, ' ');
-    } else {
-      if (pending == '#')
-        wattrset(rosterWnd, get_color(COLOR_ROSTERNMSG));
-      else {
-        int color = get_color(COLOR_ROSTER);
-        if ((!isspe) && (!isgrp)) { // Look for color rules
-          GSList *head;
-          const char *bjid = buddy_getjid(BUDDATA(buddy));
-          for (head = rostercolrules; head; head = g_slist_next(head)) {
-            rostercolor *rc = head->data;
-            if (g_pattern_match_string(rc->compiled, bjid) &&
-                (!strcmp("*", rc->status) || strchr(rc->status, status))) {
+      if (ismuc) {
+        if (buddy_getinsideroom(BUDDATA(buddy)))
+          status = 'C';
+        else
+          status = 'x';
+      } else if (currentstatus != offline) {
+        enum imstatus budstate;
+        budstate = buddy_getstatus(BUDDATA(buddy), NULL);
+        if (budstate < imstatus_size)
+          status = imstatus2char[budstate];
+      }
+      if (buddy == current_buddy) {
+        if (pending == '#')
+          attr = get_color(COLOR_ROSTERSELNMSG);
+        else
+          attr = get_color(COLOR_ROSTERSEL);
+      } else {
+        if (pending == '#')
+          attr = get_color(COLOR_ROSTERNMSG);
+        else {
+          int color = get_color(COLOR_ROSTER);
+          if ((!isspe) && (!isgrp)) { // Look for color rules
+            rostercolor *rc;
+            rc = rostercolor_lookup(buddy_getjid(BUDDATA(buddy)), status);
+            if (rc)
               color = compose_color(rc->color);
-              break;
-            }
           }
+          attr = color;
         }
-        wattrset(rosterWnd, color);
       }
-    }
 
-    if (Roster_Width > prefix_length)
-      g_utf8_strncpy(name, buddy_getname(BUDDATA(buddy)), Roster_Width-prefix_length);
-    else
-      name[0] = 0;
-
-    if (pending == '#') {
-      // Attention sign?
-      if ((ismuc && isurg >= ui_attn_sign_prio_level_muc) ||
-          (!ismuc && isurg >= ui_attn_sign_prio_level))
-        pending = attention_sign();
-    }
+      if (Roster_Width > prefix_length)
+        g_utf8_strncpy(name, buddy_getname(BUDDATA(buddy)),
+                       Roster_Width-prefix_length);
+      else
+        name[0] = 0;
 
-    if (isgrp) {
-      if (ishid) {
-        int group_count = 0;
-        foreach_group_member(BUDDATA(buddy), increment_if_buddy_not_filtered,
-                             &group_count);
-        snprintf(rline, 4*Roster_Width, "%s%lc+++ %s (%i)", space, pending,
-                 name, group_count);
-        /* Do not display the item count if there isn't enough space */
-        if (g_utf8_strlen(rline, 4*Roster_Width) >= Roster_Width)
-          snprintf(rline, 4*Roster_Width, "%s%lc+++ %s", space, pending, name);
+      if (pending == '#') {
+        // Attention sign?
+        if ((ismuc && isurg >= ui_attn_sign_prio_level_muc) ||
+            (!ismuc && isurg >= ui_attn_sign_prio_level))
+          pending = attention_sign();
       }
-      else
-        snprintf(rline, 4*Roster_Width, "%s%lc--- %s", space, pending, name);
-    } else if (isspe) {
-      snprintf(rline, 4*Roster_Width, "%s%lc%s", space, pending, name);
-    } else {
-      char sepleft  = '[';
-      char sepright = ']';
-      if (btype & ROSTER_TYPE_USER) {
-        guint subtype = buddy_getsubscription(BUDDATA(buddy));
-        if (status == '_' && !(subtype & sub_to))
-          status = '?';
-        if (!(subtype & sub_from)) {
-          sepleft  = '{';
-          sepright = '}';
+
+      if (isgrp) {
+        if (ishid) {
+          guint group_count = buddy_getgroupvisible(BUDDATA(buddy));
+          snprintf(rline, 4*Roster_Width, "%s%lc+++ %s (%u)", space, pending,
+                   name, group_count);
+          /* Do not display the item count if there isn't enough space */
+          if (g_utf8_strlen(rline, 4*Roster_Width) >= Roster_Width)
+            snprintf(rline, 4*Roster_Width, "%s%lc+++ %s", space, pending,
+                     name);
+        }
+        else
+          snprintf(rline, 4*Roster_Width, "%s%lc--- %s", space, pending, name);
+      } else if (isspe) {
+        snprintf(rline, 4*Roster_Width, "%s%lc%s", space, pending, name);
+      } else {
+        char sepleft  = '[';
+        char sepright = ']';
+        if (btype & ROSTER_TYPE_USER) {
+          guint subtype = buddy_getsubscription(BUDDATA(buddy));
+          if (status == '_' && !(subtype & sub_to))
+            status = '?';
+          if (!(subtype & sub_from)) {
+            sepleft  = '{';
+            sepright = '}';
+          }
         }
+        snprintf(rline, 4*Roster_Width, "%s%lc%c%c%c %s",
+                 space, pending, sepleft, status, sepright, name);
       }
-      snprintf(rline, 4*Roster_Width, "%s%lc%c%c%c %s",
-               space, pending, sepleft, status, sepright, name);
+
+      rline_locale = from_utf8_ref(rline);
+    }
+
+    // Repaint the row if it has changed
+    if (g_strcmp0(rline_locale, row->line) || attr != row->attr ||
+        selected != row->selected) {
+      // Clear the row; the selected row is colored entirely
+      wattrset(rosterWnd, selected ? attr : get_color(COLOR_GENERAL));
+      wmove(rosterWnd, i, x_pos);
+      for (n = 0; n < maxx; n++)
+        waddch(rosterWnd, ' ');
+      if (rline_locale) {
+        wattrset(rosterWnd, attr);
+        mvwprintw(rosterWnd, i, x_pos, "%s", rline_locale);
+      }
+      g_free(row->line);
+      row->line = g_strdup(rline_locale);
+      row->attr = attr;
+      row->selected = selected;
     }
+    row->buddy = bdata;
+    row->serial = bserial;
+    if (rline_locale != rline)
+      g_free(rline_locale);
 
-    rline_locale = from_utf8(rline);
-    mvwprintw(rosterWnd, i, x_pos, "%s", rline_locale);
-    g_free(rline_locale);
-    i++;
+    if (buddy)
+      buddy = g_list_next(buddy);
   }
 
   g_free(rline);
@@ -2381,6 +3073,7 @@ static inline void set_autoaway(bool setaway)
   static enum imstatus oldstatus;
   static char *oldmsg;
   Autoaway = setaway;
+  csi_set_idle(setaway);
 
   if (setaway) {
     const char *msg, *prevmsg;
@@ -2495,6 +3188,8 @@ static void scr_reinstall_autoaway_timeout(void)
 // Check if we should reset autoaway timeout source
 void scr_check_auto_away(int activity)
 {
+  if (activity)
+    csi_activity();
   if (Autoaway && activity) {
     scr_reinstall_autoaway_timeout();
     set_autoaway(FALSE);
@@ -2842,7 +3537,7 @@ void scr_buffer_scroll_up_down(int updown, unsigned int nblines)
   }
 
   // Refresh the window
-  scr_update_window(win_entry);
+  scr_update_window(win_entry, TRUE);
 
   // Finished :)
   update_panels();
@@ -2865,7 +3560,7 @@ void scr_buffer_clear(void)
   win_entry->bd->top = NULL;
 
   // Refresh the window
-  scr_update_window(win_entry);
+  scr_update_window(win_entry, TRUE);
 
   // Finished :)
   update_panels();
@@ -2883,6 +3578,9 @@ static gboolean buffer_purge(gpointer key, gpointer value, gpointer data)
   winbuf *win_entry = value;
   gboolean retval = FALSE;
 
+  if (chat_painted.win == win_entry)
+    chat_painted.win = NULL;
+
   // Delete the current hbuf
   // unless we close the buffer *and* this is a shared bd structure
   if (!(*p_closebuf && win_entry->bd->refcount))
@@ -2954,6 +3652,8 @@ void scr_buffer_purge(int closebuf, const char *jid)
   } else {
     // (Special buffer)
     // Reset the current hbuf
+    if (chat_painted.win == win_entry)
+      chat_painted.win = NULL;
     hbuf_free(&win_entry->bd->hbuf);
     // Currently it can only be the status buffer
     statushbuf = NULL;
@@ -3085,7 +3785,7 @@ void scr_buffer_top_bottom(int topbottom)
     win_entry->bd->top = g_list_first(win_entry->bd->hbuf);
 
   // Refresh the window
-  scr_update_window(win_entry);
+  scr_update_window(win_entry, TRUE);
 
   // Finished :)
   update_panels();
@@ -3118,7 +3818,7 @@ void scr_buffer_search(int direction, const char *text)
     win_entry->bd->top = search_res;
 
     // Refresh the window
-    scr_update_window(win_entry);
+    scr_update_window(win_entry, TRUE);
 
     // Finished :)
     update_panels();
@@ -3151,7 +3851,7 @@ void scr_buffer_percent(int pc)
   win_entry->bd->top = search_res;
 
   // Refresh the window
-  scr_update_window(win_entry);
+  scr_update_window(win_entry, TRUE);
 
   // Finished :)
   update_panels();
@@ -3181,7 +3881,7 @@ void scr_buffer_date(time_t t)
     scr_log_print(LPRINT_NORMAL, "Date not found.");
 
   // Refresh the window
-  scr_update_window(win_entry);
+  scr_update_window(win_entry, TRUE);
 
   // Finished :)
   update_panels();
@@ -3213,7 +3913,7 @@ void scr_buffer_jump_readmark(void)
   win_entry->bd->top = search_res;
 
   // Refresh the window
-  scr_update_window(win_entry);
+  scr_update_window(win_entry, TRUE);
 
   // Finished :)
   update_panels();
@@ -4128,14 +4828,18 @@ static inline void check_offset(int direction)
   inputline_offset = c - inputLine;
 }
 
-#if defined(WITH_ENCHANT) || defined(WITH_ASPELL)
-// prints inputLine with underlined words when misspelled
-static inline void print_checked_line(void)
+//  draw_inputline()
+// Print inputLine (from inputline_offset) with underlined words when
+// misspelled, and put the cursor at its position.
+// Only the characters after the first change since the previous call
+// are printed again.
+static void draw_inputline(void)
 {
   char *wprint_char_fmt = "%c";
-  int point;
-  int nrchar = maxX;
-  char *ptrCur = inputLine + inputline_offset;
+  char *line = inputLine + inputline_offset;
+  char *ptrCur;
+  int start = 0, len, oldlen, x;
+  int cursor_x = -1;
 
 #ifdef UNICODE
   // We need this to display a single UTF-8 char... Any better solution?
@@ -4143,48 +4847,68 @@ static inline void print_checked_line(void)
     wprint_char_fmt = "%lc";
 #endif
 
-  wmove(inputWnd, 0, 0); // problem with backspace
-
-  while (*ptrCur && nrchar-- > 0) {
-    point = ptrCur - inputLine;
-    if (maskLine[point])
-      wattrset(inputWnd, A_UNDERLINE);
-    wprintw(inputWnd, wprint_char_fmt, get_char(ptrCur));
-    wattrset(inputWnd, A_NORMAL);
-    ptrCur = next_char(ptrCur);
+  len = strlen(line);
+  if (inputline_shown.valid && inputline_shown.offset == inputline_offset) {
+    // Skip the part which has not changed...
+    while (line[start] && line[start] == inputline_shown.line[start] &&
+           maskLine[inputline_offset+start] == inputline_shown.mask[start])
+      start++;
+    // ...and restart at the beginning of a displayed char
+    while (start > 0 && inputline_shown.col[start] < 0)
+      start--;
+    oldlen = strlen(inputline_shown.line);
+  } else {
+    oldlen = INPUTLINE_LENGTH;
+  }
+  wmove(inputWnd, 0, start ? inputline_shown.col[start] : 0);
+  memset(&inputline_shown.col[start], 0xff,
+         (MAX(len, oldlen) - start + 1) * sizeof(inputline_shown.col[0]));
+
+  for (ptrCur = line + start; *ptrCur; ptrCur = next_char(ptrCur)) {
+    x = getcurx(inputWnd);
+    inputline_shown.col[ptrCur - line] = x;
+    if (ptrCur == ptr_inputline)
+      cursor_x = x;
+    wattrset(inputWnd, maskLine[ptrCur - inputLine] ? A_UNDERLINE : A_NORMAL);
+    // Stop at the end of the window
+    if (wprintw(inputWnd, wprint_char_fmt, get_char(ptrCur)) == ERR)
+      break;
   }
+  wattrset(inputWnd, A_NORMAL);
+  x = getcurx(inputWnd);
+  if (!*ptrCur)
+    inputline_shown.col[ptrCur - line] = x;
+  wclrtoeol(inputWnd);
+
+  memcpy(inputline_shown.line + start, line + start, len - start + 1);
+  memcpy(inputline_shown.mask + start, maskLine + inputline_offset + start,
+         len - start + 1);
+  inputline_shown.offset = inputline_offset;
+  inputline_shown.valid = TRUE;
+
+  // Place the cursor.  Characters can have different widths, so we use
+  // the columns recorded when they were printed.
+  if (ptr_inputline >= line && ptr_inputline < line + start)
+    cursor_x = inputline_shown.col[ptr_inputline - line];
+  if (cursor_x < 0)
+    cursor_x = x;
+  wmove(inputWnd, 0, cursor_x);
 }
-#endif
 
 static inline void refresh_inputline(void)
 {
 #if defined(WITH_ENCHANT) || defined(WITH_ASPELL)
   if (settings_opt_get_int("spell_enable")) {
-    memset(maskLine, 0, INPUTLINE_LENGTH+1);
-    spellcheck(inputLine, maskLine);
-  }
-  print_checked_line();
-  wclrtoeol(inputWnd);
-  if (*ptr_inputline) {
-    // hack to set cursor pos. Characters can have different width,
-    // so I know of no better way.
-    char c = *ptr_inputline;
-    *ptr_inputline = 0;
-    print_checked_line();
-    *ptr_inputline = c;
-  }
-#else
-  mvwprintw(inputWnd, 0, 0, "%s", inputLine + inputline_offset);
-  wclrtoeol(inputWnd);
-  if (*ptr_inputline) {
-    // hack to set cursor pos. Characters can have different width,
-    // so I know of no better way.
-    char c = *ptr_inputline;
-    *ptr_inputline = 0;
-    mvwprintw(inputWnd, 0, 0, "%s", inputLine + inputline_offset);
-    *ptr_inputline = c;
+    // The words are only checked again when the line has changed
+    if (!spell_line_checked || strcmp(inputLine, spell_line)) {
+      memset(maskLine, 0, INPUTLINE_LENGTH+1);
+      spellcheck(inputLine, maskLine);
+      strcpy(spell_line, inputLine);
+      spell_line_checked = TRUE;
+    }
   }
 #endif
+  draw_inputline();
 }
 
 void scr_handle_CtrlC(void)
@@ -4371,6 +5095,68 @@ void scr_do_update(void)
   if (colors_stalled)
     parse_colors();
   doupdate();
+  if (offscreen.term)
+    offscreen_count_cells();
+}
+
+static gboolean frame_timeout(gpointer data)
+{
+  // Nothing to do here: the main loop will paint the frame
+  // (see scr_paint_frame()) as soon as we return.
+  frame_timer = 0;
+  return FALSE;
+}
+
+//  scr_paint_frame(force)
+// Repaint the parts of the screen which have been marked as dirty
+// (current chat window, roster, log window) and update the terminal.
+// Unless force is TRUE, at most "redraw_max_fps" frames are painted per
+// second: if the last frame is too recent, a timeout is set up so that
+// the main loop is woken up when the next frame is due.
+void scr_paint_frame(int force)
+{
+  struct timeval now;
+  const char *fps_str;
+  int fps;
+
+  if (!update_chat && !update_roster && !log_ring.pending && !log_ring.full) {
+    scr_do_update();
+    return;
+  }
+
+  gettimeofday(&now, NULL);
+  fps_str = settings_opt_get("redraw_max_fps");
+  fps = fps_str ? atoi(fps_str) : DEFAULT_REDRAW_MAX_FPS;
+  if (!force && fps > 0) {
+    long delay = 1000000L / fps -
+                 ((now.tv_sec - last_frame.tv_sec) * 1000000L +
+                  now.tv_usec - last_frame.tv_usec);
+    // (Ignore the delay if the clock has gone backwards)
+    if (delay > 0 && delay <= 1000000L) {
+      if (!frame_timer)
+        frame_timer = g_timeout_add(delay / 1000 + 1, frame_timeout, NULL);
+      return;
+    }
+  }
+
+  if (frame_timer) {
+    g_source_remove(frame_timer);
+    frame_timer = 0;
+  }
+
+  if (update_chat) {
+    update_chat = FALSE;
+    if (chatmode && currentWindow) {
+      scr_update_window(currentWindow, FALSE);
+      top_panel(inputPanel);
+      update_panels();
+    }
+  }
+  if (update_roster)
+    scr_draw_roster();
+  scr_draw_log_ring();
+  scr_do_update();
+  last_frame = now;
 }
 
 static void bindcommand(keycode kcode)
@@ -4595,9 +5381,27 @@ void spellcheck_init(void)
   g_strfreev(langs);
 }
 
+//  spell_cache_clear()
+// Forget the verdicts of the spell checkers.
+static void spell_cache_clear(void)
+{
+  spell_verdict *verdict;
+
+  while ((verdict = g_queue_pop_head(&spell_lru)) != NULL) {
+    g_free(verdict->word);
+    g_free(verdict);
+  }
+  if (spell_cache) {
+    g_hash_table_destroy(spell_cache);
+    spell_cache = NULL;
+  }
+  spell_line_checked = FALSE;
+}
+
 // Deinitialization of spellchecker
 void spellcheck_deinit(void)
 {
+  spell_cache_clear();
   g_slist_free_full(spell_checkers, spell_checker_free);
   spell_checkers = NULL;
 }
@@ -4622,6 +5426,43 @@ static int spellcheckword(gconstpointer sc_ptr, gconstpointer substr_ptr)
   return 0; // Keep compiler happy
 }
 
+//  spellcheck_cached(substr)
+// Return TRUE if the word is accepted by one of the spell checkers.
+// The verdicts of the last SPELL_CACHE_SIZE words are cached.
+static gboolean spellcheck_cached(spell_substring *substr)
+{
+  static char word[INPUTLINE_LENGTH+1];
+  spell_verdict *verdict;
+  GList *link;
+
+  if (!spell_cache)
+    spell_cache = g_hash_table_new(g_str_hash, g_str_equal);
+
+  g_strlcpy(word, substr->str, MIN(substr->len + 1, (int)sizeof(word)));
+  link = g_hash_table_lookup(spell_cache, word);
+  if (link) {
+    // Move the word to the head of the list
+    g_queue_unlink(&spell_lru, link);
+    g_queue_push_head_link(&spell_lru, link);
+    return ((spell_verdict*)link->data)->good;
+  }
+
+  verdict = g_new(spell_verdict, 1);
+  verdict->word = g_strdup(word);
+  verdict->good = (g_slist_find_custom(spell_checkers, substr,
+                                       spellcheckword) != NULL);
+  g_queue_push_head(&spell_lru, verdict);
+  g_hash_table_insert(spell_cache, verdict->word, spell_lru.head);
+
+  if (spell_lru.length > SPELL_CACHE_SIZE) {
+    spell_verdict *old = g_queue_pop_tail(&spell_lru);
+    g_hash_table_remove(spell_cache, old->word);
+    g_free(old->word);
+    g_free(old);
+  }
+  return verdict->good;
+}
+
 #define spell_isalpha(c) (utf8_mode ? iswalpha(get_char(c)) : isalpha(*c))
 
 // Spell checking function
@@ -4671,7 +5512,7 @@ static void spellcheck(char *line, char *checked)
 
     substr.str = start;
     substr.len = line - start;
-    if (!g_slist_find_custom(spell_checkers, &substr, spellcheckword))
+    if (!spellcheck_cached(&substr))
       memset(&checked[start - line_start], SPELLBADCHAR, line - start);
   }
 }
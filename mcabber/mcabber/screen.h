@@ -103,6 +103,7 @@ void scr_process_key(keycode kcode);
 
 void scr_init_bindings(void);
 void scr_init_locale_charset(void);
+void scr_set_offscreen(void);
 void scr_init_curses(void);
 void scr_init_settings(void);
 void scr_terminate_curses(void);
@@ -110,6 +111,7 @@ gboolean scr_curses_status(void);
 void scr_resize(void);
 void scr_draw_main_window(unsigned int fullinit);
 void scr_draw_roster(void);
+void scr_paint_frame(int force);
 void scr_update_main_status(int forceupdate);
 void scr_update_chat_status(int forceupdate);
 void scr_roster_visibility(int status);
@@ -0,0 +1,283 @@
+/*
+ * sendq.c      -- Outgoing stanza queue
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/*
+ * The stanzas are serialized and queued, and the queue is written in a
+ * single call from an idle callback, i.e. once the pending keyboard and
+ * network events have been handled.
+ * If the 'send_rate_limit' option is set, the output is limited to that
+ * many bytes per second (token bucket), and the rest of the queue is sent
+ * later.
+ * Requests with a reply handler are queued as messages, and given to
+ * loudmouth (which registers the handler) when they reach the head of the
+ * queue, so that the order is preserved.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "sendq.h"
+#include "settings.h"
+#include "logprint.h"
+#include "screen.h"
+#include "xmpp.h"
+
+#define SENDQ_MIN_BURST   2048  // Bytes
+#define SENDQ_MIN_DELAY   20    // Milliseconds between two rate-limited writes
+
+struct sendq_item {
+  gchar *xml;                 // Serialized stanza or raw data
+  gsize len;
+  LmMessage *m;               // Request waiting for a reply, or NULL
+  LmMessageHandler *handler;
+};
+
+static struct {
+  GQueue queue;         // struct sendq_item
+  gsize bytes;          // Size of the queue
+  glong tokens;         // Bytes we can send now (rate limit)
+  struct timeval refill;
+  guint source;
+  gboolean throttled;   // Displayed in the status bar
+  guint max_depth;      // Since the last report
+} sendq = { G_QUEUE_INIT, 0, 0, {0, 0}, 0, FALSE, 0 };
+
+static gboolean sendq_cb(gpointer data);
+
+//  sendq_refill(rate)
+// Update the token bucket.
+static void sendq_refill(glong rate)
+{
+  struct timeval now;
+  glong ms, burst = MAX(rate, SENDQ_MIN_BURST);
+
+  gettimeofday(&now, NULL);
+  ms = (now.tv_sec - sendq.refill.tv_sec) * 1000L +
+       (now.tv_usec - sendq.refill.tv_usec) / 1000L;
+  if (!sendq.refill.tv_sec || ms < 0 || ms > 1000L * burst / rate)
+    sendq.tokens = burst;
+  else
+    sendq.tokens = MIN(burst, sendq.tokens + rate * ms / 1000L);
+  sendq.refill = now;
+}
+
+static void sendq_item_free(struct sendq_item *item)
+{
+  g_free(item->xml);
+  if (item->m)
+    lm_message_unref(item->m);
+  if (item->handler)
+    lm_message_handler_unref(item->handler);
+  g_free(item);
+}
+
+static void sendq_push(struct sendq_item *item)
+{
+  g_queue_push_tail(&sendq.queue, item);
+  sendq.bytes += item->len;
+
+  if (!sendq.source)
+    sendq.source = g_idle_add(sendq_cb, NULL);
+}
+
+//  sendq_set_throttled(throttled)
+// Update the status bar, which displays the queue depth while the queue
+// is delayed by the rate limit.
+static void sendq_set_throttled(gboolean throttled)
+{
+  if (!throttled && !sendq.throttled)
+    return;
+  if (!throttled) {
+    scr_LogPrint(LPRINT_DEBUG, "Send queue: up to %u stanzas delayed by "
+                 "the rate limit.", sendq.max_depth);
+    sendq.max_depth = 0;
+  }
+  sendq.throttled = throttled;
+  scr_update_main_status(TRUE);
+}
+
+//  sendq_flush(force)
+// Write the queued stanzas.  Unless force is TRUE, stop when the rate
+// limit is reached.
+void sendq_flush(gboolean force)
+{
+  glong rate = settings_opt_get_int("send_rate_limit");
+  GString *batch;
+  struct sendq_item *item;
+  GError *error = NULL;
+
+  if (sendq.source) {
+    g_source_remove(sendq.source);
+    sendq.source = 0;
+  }
+  if (g_queue_is_empty(&sendq.queue))
+    return;
+  if (!lconnection) {
+    sendq_reset();
+    return;
+  }
+
+  if (rate > 0)
+    sendq_refill(rate);
+
+  batch = g_string_sized_new(MIN(sendq.bytes, 16384));
+  while ((item = g_queue_peek_head(&sendq.queue)) != NULL) {
+    // We always send at least one stanza, even if it is big
+    if (!force && rate > 0 && sendq.tokens <= 0)
+      break;
+    g_queue_pop_head(&sendq.queue);
+    sendq.bytes -= item->len;
+    sendq.tokens -= item->len;
+    if (item->m) {
+      // Write what precedes the request first
+      if (batch->len) {
+        lm_connection_send_raw(lconnection, batch->str, NULL);
+        g_string_truncate(batch, 0);
+      }
+      if (!lm_connection_send_with_reply(lconnection, item->m, item->handler,
+                                         &error)) {
+        scr_LogPrint(LPRINT_LOGNORM, "Error sending IQ request: %s.",
+                     error ? error->message : "unknown error");
+        g_clear_error(&error);
+      }
+    } else {
+      g_string_append_len(batch, item->xml, item->len);
+    }
+    sendq_item_free(item);
+  }
+  if (batch->len)
+    lm_connection_send_raw(lconnection, batch->str, NULL);
+  g_string_free(batch, TRUE);
+
+  if (g_queue_is_empty(&sendq.queue)) {
+    sendq_set_throttled(FALSE);
+    return;
+  }
+
+  // Wait until we have enough tokens for the next stanza
+  {
+    glong ms = (1 - sendq.tokens) * 1000L / rate;
+    sendq.max_depth = MAX(sendq.max_depth, g_queue_get_length(&sendq.queue));
+    sendq.source = g_timeout_add(MAX(ms, SENDQ_MIN_DELAY), sendq_cb, NULL);
+    sendq_set_throttled(TRUE);
+  }
+}
+
+static gboolean sendq_cb(gpointer data)
+{
+  sendq.source = 0;
+  sendq_flush(FALSE);
+  return FALSE;
+}
+
+//  sendq_send(m)
+// Queue the message m, it will be sent during the next main loop
+// iteration.  The caller still owns m.
+void sendq_send(LmMessage *m)
+{
+  struct sendq_item *item;
+  gchar *xml;
+
+  if (!lconnection)
+    return;
+
+  xml = lm_message_node_to_string(m->node);
+  if (!xml)
+    return;
+  item = g_new0(struct sendq_item, 1);
+  item->xml = xml;
+  item->len = strlen(xml);
+  sendq_push(item);
+}
+
+//  sendq_send_with_reply(m, handler, error)
+// Queue the request m; the reply will be passed to handler.  The caller
+// still owns m and handler.
+// Return FALSE (and set error) if there is no connection.
+gboolean sendq_send_with_reply(LmMessage *m, LmMessageHandler *handler,
+                               GError **error)
+{
+  struct sendq_item *item;
+  gchar *xml;
+
+  if (!lconnection) {
+    g_set_error(error, LM_ERROR, LM_ERROR_CONNECTION_NOT_OPEN,
+                "Connection is not open");
+    return FALSE;
+  }
+
+  // The size is only needed for the rate limit
+  xml = lm_message_node_to_string(m->node);
+  item = g_new0(struct sendq_item, 1);
+  item->len = xml ? strlen(xml) : 0;
+  item->m = lm_message_ref(m);
+  item->handler = lm_message_handler_ref(handler);
+  g_free(xml);
+  sendq_push(item);
+  return TRUE;
+}
+
+//  sendq_send_raw(xml)
+// Queue raw data.
+void sendq_send_raw(const char *xml)
+{
+  struct sendq_item *item;
+
+  if (!lconnection)
+    return;
+
+  item = g_new0(struct sendq_item, 1);
+  item->xml = g_strdup(xml);
+  item->len = strlen(xml);
+  sendq_push(item);
+}
+
+//  sendq_reset()
+// Drop the queue (the connection has been closed).
+void sendq_reset(void)
+{
+  struct sendq_item *item;
+
+  if (sendq.source) {
+    g_source_remove(sendq.source);
+    sendq.source = 0;
+  }
+  while ((item = g_queue_pop_head(&sendq.queue)) != NULL)
+    sendq_item_free(item);
+  sendq.bytes = 0;
+  sendq.refill.tv_sec = 0;
+  sendq_set_throttled(FALSE);
+}
+
+//  sendq_status()
+// Return a short description of the queue if it is delayed by the rate
+// limit, or NULL.
+const char *sendq_status(void)
+{
+  static char buf[48];
+
+  if (!sendq.throttled)
+    return NULL;
+  snprintf(buf, sizeof(buf), "%u queued, %lu bytes",
+           g_queue_get_length(&sendq.queue), (unsigned long)sendq.bytes);
+  return buf;
+}
+
+/* vim: set expandtab cindent cinoptions=>2\:2(0 sw=2 ts=2:  For Vim users... */
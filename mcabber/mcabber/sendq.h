@@ -0,0 +1,17 @@
+#ifndef __MCABBER_SENDQ_H__
+#define __MCABBER_SENDQ_H__ 1
+
+#include <glib.h>
+#include <loudmouth/loudmouth.h>
+
+void sendq_send(LmMessage *m);
+gboolean sendq_send_with_reply(LmMessage *m, LmMessageHandler *handler,
+                               GError **error);
+void sendq_send_raw(const char *xml);
+void sendq_flush(gboolean force);
+void sendq_reset(void);
+const char *sendq_status(void);
+
+#endif /* __MCABBER_SENDQ_H__ */
+
+/* vim: set expandtab cindent cinoptions=>2\:2(0 sw=2 ts=2:  For Vim users... */
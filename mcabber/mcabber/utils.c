@@ -50,6 +50,7 @@ static char idnprep[1024];
 #include <ctype.h>
 
 #include "utils.h"
+#include "utf8.h"
 #include "logprint.h"
 #include "settings.h"
 #include "main.h"
@@ -720,6 +721,62 @@ void replace_nl_with_dots(char *bufstr)
   }
 }
 
+// Locale conversions made by from_utf8_ref() and to_utf8_ref()
+static struct {
+  guint calls;
+  guint allocs;   // Conversions which returned a new string
+} conv_count;
+
+//  from_utf8_ref(text)
+// Convert UTF-8 string text to the user's locale.
+// When the locale is UTF-8 no conversion is needed: a pointer to text is
+// returned (be careful _not_ to free the pointer in this case), or NULL if
+// text is not valid UTF-8.
+// Otherwise a new converted string is returned (or NULL on failure); this
+// is up to the caller to free this string after use.
+char *from_utf8_ref(const char *text)
+{
+  char *conv;
+
+  if (!text)
+    return NULL;
+  conv_count.calls++;
+  if (utf8_mode)
+    return g_utf8_validate(text, -1, NULL) ? (char*)text : NULL;
+  conv = from_utf8(text);
+  if (conv)
+    conv_count.allocs++;
+  return conv;
+}
+
+//  to_utf8_ref(text)
+// Convert string text from the user's locale to UTF-8.
+// Same as from_utf8_ref(), the original pointer is returned when the locale
+// is UTF-8, and a new string is allocated only if a conversion is needed.
+char *to_utf8_ref(const char *text)
+{
+  char *conv;
+
+  if (!text)
+    return NULL;
+  conv_count.calls++;
+  if (utf8_mode)
+    return g_utf8_validate(text, -1, NULL) ? (char*)text : NULL;
+  conv = to_utf8(text);
+  if (conv)
+    conv_count.allocs++;
+  return conv;
+}
+
+//  ut_conv_count(calls, allocs)
+// Get the number of conversions made by from_utf8_ref() and to_utf8_ref()
+// so far, and the number of strings they have allocated.
+void ut_conv_count(guint *calls, guint *allocs)
+{
+  *calls = conv_count.calls;
+  *allocs = conv_count.allocs;
+}
+
 //  ut_expand_tabs(text)
 // Expand tabs and filter out some bad chars in string text.
 // If there is no tab and no bad chars in the string, a pointer to text
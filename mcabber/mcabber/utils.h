@@ -47,6 +47,9 @@ char **split_arg(const char *arg, unsigned int n, int dontstriplast);
 void free_arg_lst(char **arglst);
 
 void replace_nl_with_dots(char *bufstr);
+char *from_utf8_ref(const char *text);
+char *to_utf8_ref(const char *text);
+void ut_conv_count(guint *calls, guint *allocs);
 char *ut_expand_tabs(const char *text);
 char *ut_unescape_tabs_cr(const char *text);
 
@@ -23,6 +23,13 @@
  */
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <gio/gio.h>
 
 #include "xmpp.h"
 #include "xmpp_helper.h"
@@ -41,8 +48,19 @@
 #include "utils.h"
 #include "main.h"
 #include "carbons.h"
+#include "csi.h"
+#include "sendq.h"
 
-#define RECONNECTION_TIMEOUT    60L
+#define RECONNECT_DELAY_MIN     10L   // Seconds before the first attempt
+#define RECONNECT_DELAY_MAX     900L
+#define RECONNECT_PROBE_TIMEOUT 10    // Seconds, for the TCP probe
+
+#define CAPS_QUERIES_MAX        4   // Concurrent XEP-0115 disco queries
+#define CAPS_QUERY_TIMEOUT      30  // Seconds before asking someone else
+
+#define PRESENCE_BATCH_MAX      1024  // Flush a batch before it gets larger
+
+#define BOOTSTRAP_TIMEOUT       30  // Seconds to wait for the login replies
 
 #ifndef LOUDMOUTH_USES_SHA256
 #define FINGERPRINT_LENGTH      16  // old loudmouth still uses MD5 :(
@@ -52,7 +70,10 @@ LmConnection* lconnection = NULL;
 static guint AutoConnection;
 
 inline void update_last_use(void);
-inline gboolean xmpp_reconnect();
+static void caps_queries_reset(void);
+static void presences_reset(void);
+static void bootstrap_start(void);
+static void bootstrap_reset(void);
 
 enum imstatus mystatus = offline;
 static enum imstatus mywantedstatus = available;
@@ -136,7 +157,7 @@ void xmpp_addbuddy(const char *bjid, const char *name, const char *group)
     lm_message_node_add_child(y, "group", group);
 
   handler = lm_message_handler_new(handle_iq_dummy, NULL, FALSE);
-  lm_connection_send_with_reply(lconnection, iq, handler, NULL);
+  sendq_send_with_reply(iq, handler, NULL);
   lm_message_handler_unref(handler);
   lm_message_unref(iq);
 
@@ -176,7 +197,7 @@ void xmpp_updatebuddy(const char *bjid, const char *name, const char *group)
     lm_message_node_add_child(x, "group", group);
 
   handler = lm_message_handler_new(handle_iq_dummy, NULL, FALSE);
-  lm_connection_send_with_reply(lconnection, iq, handler, NULL);
+  sendq_send_with_reply(iq, handler, NULL);
   lm_message_handler_unref(handler);
   lm_message_unref(iq);
   g_free(cleanjid);
@@ -204,7 +225,7 @@ void xmpp_delbuddy(const char *bjid)
     lm_message_node_set_attribute(y, "xmlns", NS_REGISTER);
     lm_message_node_add_child(y, "remove", NULL);
     handler = lm_message_handler_new(handle_iq_dummy, NULL, FALSE);
-    lm_connection_send_with_reply(lconnection, iq, handler, NULL);
+    sendq_send_with_reply(iq, handler, NULL);
     lm_message_handler_unref(handler);
     lm_message_unref(iq);
   }
@@ -225,7 +246,7 @@ void xmpp_delbuddy(const char *bjid)
                                  "subscription", "remove",
                                  NULL);
   handler = lm_message_handler_new(handle_iq_dummy, NULL, FALSE);
-  lm_connection_send_with_reply(lconnection, iq, handler, NULL);
+  sendq_send_with_reply(iq, handler, NULL);
   lm_message_handler_unref(handler);
   lm_message_unref(iq);
 
@@ -471,7 +492,7 @@ xmpp_send_msg_no_chatstates:
   if (mystatus != invisible)
 #endif
     update_last_use();
-  lm_connection_send(lconnection, x, NULL);
+  sendq_send(x);
   lm_message_unref(x);
 
 xmpp_send_msg_return:
@@ -533,7 +554,7 @@ static void xmpp_send_xep85_chatstate(const char *bjid, const char *resname,
   event = lm_message_node_add_child(m->node, chattag, NULL);
   lm_message_node_set_attribute(event, "xmlns", NS_CHATSTATES);
 
-  lm_connection_send(lconnection, m, NULL);
+  sendq_send(m);
   lm_message_unref(m);
 
   g_free(fjid);
@@ -758,6 +779,182 @@ static LmSSLResponse ssl_cb(LmSSL *ssl, LmSSLStatus status, gpointer ud)
   return LM_SSL_RESPONSE_STOP;
 }
 
+/* Post-login bootstrap
+ * Once we are authenticated, the roster, server features, bookmarks and
+ * roster notes are requested at the same time.  Our status is restored as
+ * soon as the roster request is over.  When the roster and the bookmarks
+ * have been received (or after BOOTSTRAP_TIMEOUT seconds), the roster is
+ * rebuilt and the bookmarked rooms are joined in one step: the session is
+ * then "usable".  The post-connect hook is only run if we have got the
+ * roster.
+ */
+
+#define BOOTSTRAP_USABLE (BOOTSTRAP_ROSTER|BOOTSTRAP_BOOKMARKS)
+
+struct autojoin {
+  gchar *room;
+  gchar *nick;
+  gchar *passwd;
+};
+
+static struct timeval connect_time;   // Last xmpp_connect() call
+
+static struct {
+  guint pending;          // Requests still waiting for a reply
+  guint failed;           // Requests which have failed or timed out
+  gboolean status_sent;
+  gboolean usable;
+  struct timeval start;   // Authentication
+  glong done[4];          // Reply time (ms) of each request
+  GSList *autojoin;       // Rooms to join when usable
+  guint timer;
+} bootstrap;
+
+static glong elapsed_ms(const struct timeval *since)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return (now.tv_sec - since->tv_sec) * 1000L +
+         (now.tv_usec - since->tv_usec) / 1000L;
+}
+
+static void autojoin_free(gpointer data)
+{
+  struct autojoin *aj = data;
+
+  g_free(aj->room);
+  g_free(aj->nick);
+  g_free(aj->passwd);
+  g_free(aj);
+}
+
+static void bootstrap_reset(void)
+{
+  if (bootstrap.timer)
+    g_source_remove(bootstrap.timer);
+  g_slist_free_full(bootstrap.autojoin, autojoin_free);
+  memset(&bootstrap, 0, sizeof(bootstrap));
+}
+
+static void bootstrap_usable(void)
+{
+  GSList *joins, *l;
+
+  bootstrap.usable = TRUE;
+
+  buddylist_build();
+  update_roster = TRUE;
+
+  joins = g_slist_reverse(bootstrap.autojoin);
+  bootstrap.autojoin = NULL;
+  for (l = joins; l; l = l->next) {
+    struct autojoin *aj = l->data;
+    xmpp_room_join_queued(aj->room, aj->nick, aj->passwd);
+  }
+  g_slist_free_full(joins, autojoin_free);
+
+  // Post-login stuff, only if the roster has been retrieved
+  if (bootstrap.failed & BOOTSTRAP_ROSTER)
+    scr_LogPrint(LPRINT_LOGNORM, "Could not retrieve the roster.");
+  else
+    hk_postconnect();
+
+  scr_LogPrint(LPRINT_LOGNORM, "Session ready in %ld ms "
+               "(login %ld ms, roster %ld ms, bookmarks %ld ms).",
+               elapsed_ms(&connect_time),
+               elapsed_ms(&connect_time) - elapsed_ms(&bootstrap.start),
+               bootstrap.done[0], bootstrap.done[2]);
+}
+
+static gboolean bootstrap_timeout(gpointer data)
+{
+  bootstrap.timer = 0;
+  scr_LogPrint(LPRINT_LOGNORM, "Some login requests are still unanswered "
+               "(%#x), going on anyway.", bootstrap.pending);
+  xmpp_bootstrap_failed(bootstrap.pending);
+  return FALSE;
+}
+
+static void bootstrap_start(void)
+{
+  bootstrap_reset();
+  gettimeofday(&bootstrap.start, NULL);
+  bootstrap.pending = BOOTSTRAP_ROSTER | BOOTSTRAP_DISCO |
+                      BOOTSTRAP_BOOKMARKS | BOOTSTRAP_ROSTERNOTES;
+  bootstrap.timer = g_timeout_add_seconds(BOOTSTRAP_TIMEOUT,
+                                          bootstrap_timeout, NULL);
+
+  // These requests do not depend on each other
+  xmpp_iq_request(NULL, NS_ROSTER);
+  xmpp_iq_request(NULL, NS_DISCO_INFO);
+  xmpp_request_storage("storage:bookmarks");
+  xmpp_request_storage("storage:rosternotes");
+}
+
+//  xmpp_bootstrap_done(requests)
+// Called when the reply to a post-login request (BOOTSTRAP_*) has been
+// handled.
+void xmpp_bootstrap_done(guint requests)
+{
+  guint i;
+
+  requests &= bootstrap.pending;
+  if (!requests)
+    return;
+
+  bootstrap.pending &= ~requests;
+  for (i = 0; i < G_N_ELEMENTS(bootstrap.done); i++)
+    if (requests & (1U<<i))
+      bootstrap.done[i] = elapsed_ms(&bootstrap.start);
+
+  // Do not wait for the bookmarks to send our presence
+  if (!bootstrap.status_sent && !(bootstrap.pending & BOOTSTRAP_ROSTER)) {
+    bootstrap.status_sent = TRUE;
+    xmpp_setprevstatus();
+  }
+
+  if (!bootstrap.usable && !(bootstrap.pending & BOOTSTRAP_USABLE))
+    bootstrap_usable();
+
+  if (!bootstrap.pending) {
+    if (bootstrap.timer) {
+      g_source_remove(bootstrap.timer);
+      bootstrap.timer = 0;
+    }
+    scr_LogPrint(LPRINT_DEBUG, "Login replies (ms): roster %ld, disco %ld, "
+                 "bookmarks %ld, rosternotes %ld.", bootstrap.done[0],
+                 bootstrap.done[1], bootstrap.done[2], bootstrap.done[3]);
+  }
+}
+
+//  xmpp_bootstrap_failed(requests)
+// Called when a post-login request (BOOTSTRAP_*) has failed.
+void xmpp_bootstrap_failed(guint requests)
+{
+  bootstrap.failed |= requests & bootstrap.pending;
+  xmpp_bootstrap_done(requests);
+}
+
+//  xmpp_bootstrap_defer_join(room, nick, passwd)
+// Return TRUE if the room will be joined when the session is usable,
+// FALSE if it should be joined now.
+gboolean xmpp_bootstrap_defer_join(const char *room, const char *nick,
+                                   const char *passwd)
+{
+  struct autojoin *aj;
+
+  if (bootstrap.usable || !bootstrap.pending)
+    return FALSE;
+
+  aj = g_new(struct autojoin, 1);
+  aj->room = g_strdup(room);
+  aj->nick = g_strdup(nick);
+  aj->passwd = g_strdup(passwd);
+  bootstrap.autojoin = g_slist_prepend(bootstrap.autojoin, aj);
+  return TRUE;
+}
+
 static void connection_auth_cb(LmConnection *connection, gboolean success,
                                gpointer user_data)
 {
@@ -775,39 +972,293 @@ static void connection_auth_cb(LmConnection *connection, gboolean success,
   }
 
   if (success) {
-    xmpp_iq_request(NULL, NS_ROSTER);
-    xmpp_iq_request(NULL, NS_DISCO_INFO);
-    xmpp_request_storage("storage:bookmarks");
-    xmpp_request_storage("storage:rosternotes");
-
-    /* XXX Not needed before xmpp_setprevstatus()
-    LmMessage *m;
-    m = lm_message_new_with_sub_type(NULL, LM_MESSAGE_TYPE_PRESENCE,
-                                     LM_MESSAGE_SUB_TYPE_AVAILABLE);
-    lm_connection_send(connection, m, NULL);
-    lm_message_unref(m);
-    */
+    csi_connected();
 
-    xmpp_setprevstatus();
+    // The status is restored once the roster and the bookmarks are here,
+    // see bootstrap_usable().
+    bootstrap_start();
 
     AutoConnection = TRUE;
+    xmpp_reconnect_cancel();
   } else
     scr_LogPrint(LPRINT_LOGNORM, "Authentication failed");
 }
 
-gboolean xmpp_reconnect()
+/* Reconnection scheduler
+ * The delay between two attempts doubles after each failure (up to
+ * RECONNECT_DELAY_MAX), and a random part is added so that the clients
+ * of a server which has been down do not all come back at the same time.
+ * Before a full attempt (TLS, authentication...), a simple TCP connection
+ * is tried to check that the server can be reached.
+ */
+
+static struct {
+  enum {
+    reconnect_idle,
+    reconnect_waiting,
+    reconnect_probing,
+    reconnect_connecting
+  } state;
+  guint failures;       // Consecutive failed attempts
+  guint source;         // Next attempt
+  time_t when;
+  int probe_fd;
+  int probe_port;
+  GCancellable *probe_resolve;  // Name resolution in progress
+  guint probe_watch;
+  guint probe_timer;
+} reconnect = { reconnect_idle, 0, 0, 0, -1, 0, NULL, 0, 0 };
+
+static void reconnect_set_state(int state)
 {
-  if (!lconnection)
-    xmpp_connect();
+  reconnect.state = state;
+  scr_update_main_status(TRUE);
+}
+
+static void reconnect_probe_stop(void)
+{
+  if (reconnect.probe_resolve) {
+    // The callback will be called with G_IO_ERROR_CANCELLED
+    g_cancellable_cancel(reconnect.probe_resolve);
+    g_object_unref(reconnect.probe_resolve);
+    reconnect.probe_resolve = NULL;
+  }
+  if (reconnect.probe_watch)
+    g_source_remove(reconnect.probe_watch);
+  if (reconnect.probe_timer)
+    g_source_remove(reconnect.probe_timer);
+  if (reconnect.probe_fd >= 0)
+    close(reconnect.probe_fd);
+  reconnect.probe_watch = reconnect.probe_timer = 0;
+  reconnect.probe_fd = -1;
+}
+
+static void reconnect_schedule(void);
+
+//  reconnect_probe_done(err)
+// Start a full connection attempt, unless the probe error err means the
+// server cannot be reached.
+static void reconnect_probe_done(int err)
+{
+  reconnect_probe_stop();
+
+  if (err) {
+    // Without the 'server' option, the JID domain is not necessarily the
+    // XMPP server (SRV records), so only network errors count.
+    gboolean down = (err == ENETUNREACH || err == EHOSTUNREACH ||
+                     err == ENETDOWN || err == ETIMEDOUT);
+    if (down || settings_opt_get("server")) {
+      scr_LogPrint(LPRINT_LOGNORM, "Server unreachable: %s",
+                   err > 0 ? strerror(err) : "name resolution failed");
+      reconnect_schedule();
+      return;
+    }
+  }
+
+  reconnect_set_state(reconnect_connecting);
+  xmpp_connect();
+}
+
+static gboolean reconnect_probe_cb(GIOChannel *source, GIOCondition cond,
+                                   gpointer data)
+{
+  int err = 0;
+  socklen_t len = sizeof(err);
+
+  reconnect.probe_watch = 0;
+  if (getsockopt(reconnect.probe_fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+    err = errno;
+  reconnect_probe_done(err);
+  return FALSE;
+}
+
+static gboolean reconnect_probe_timeout(gpointer data)
+{
+  reconnect.probe_timer = 0;
+  reconnect_probe_done(ETIMEDOUT);
+  return FALSE;
+}
+
+//  reconnect_probe_connect(address)
+// Start a non-blocking TCP connection to the (numeric) address.
+static void reconnect_probe_connect(const char *address)
+{
+  struct addrinfo hints, *res = NULL;
+  gchar *port;
+  GIOChannel *channel;
+  int ret, err;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICHOST;
+  port = g_strdup_printf("%d", reconnect.probe_port);
+  ret = getaddrinfo(address, port, &hints, &res);
+  g_free(port);
+  if (ret) {
+    reconnect_probe_done(0);
+    return;
+  }
+
+  reconnect.probe_fd = socket(res->ai_family, res->ai_socktype,
+                              res->ai_protocol);
+  if (reconnect.probe_fd < 0) {
+    freeaddrinfo(res);
+    reconnect_probe_done(0);
+    return;
+  }
+  fcntl(reconnect.probe_fd, F_SETFL,
+        fcntl(reconnect.probe_fd, F_GETFL) | O_NONBLOCK);
+  ret = connect(reconnect.probe_fd, res->ai_addr, res->ai_addrlen);
+  err = errno;
+  freeaddrinfo(res);
+
+  if (!ret || err != EINPROGRESS) {
+    reconnect_probe_done(ret ? err : 0);
+    return;
+  }
+
+  channel = g_io_channel_unix_new(reconnect.probe_fd);
+  reconnect.probe_watch = g_io_add_watch(channel, G_IO_OUT|G_IO_ERR|G_IO_HUP,
+                                         reconnect_probe_cb, NULL);
+  g_io_channel_unref(channel);
+}
+
+static void reconnect_probe_resolved(GObject *source, GAsyncResult *result,
+                                     gpointer data)
+{
+  GError *error = NULL;
+  GList *addresses;
+  gchar *address;
+
+  addresses = g_resolver_lookup_by_name_finish(G_RESOLVER(source), result,
+                                               &error);
+  if (error && g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+    // The probe has been stopped
+    g_error_free(error);
+    return;
+  }
+  g_object_unref(reconnect.probe_resolve);
+  reconnect.probe_resolve = NULL;
+
+  if (!addresses) {
+    g_error_free(error);
+    // Do not give up because of a DNS error if we don't know the server
+    reconnect_probe_done(settings_opt_get("server") ? -1 : 0);
+    return;
+  }
+
+  address = g_inet_address_to_string(addresses->data);
+  g_resolver_free_addresses(addresses);
+  reconnect_probe_connect(address);
+  g_free(address);
+}
+
+//  reconnect_probe()
+// Try a TCP connection to the server (or to the proxy).  The name
+// resolution is asynchronous, so that the UI is not blocked when the
+// network is down.
+static void reconnect_probe(void)
+{
+  const char *proxy_host = settings_opt_get("proxy_host");
+  GResolver *resolver;
+  gchar *host;
+
+  if (proxy_host) {
+    host = g_strdup(proxy_host);
+    reconnect.probe_port = settings_opt_get_int("proxy_port");
+  } else {
+    host = get_servername(settings_opt_get("jid"), settings_opt_get("server"));
+    reconnect.probe_port = settings_opt_get_int("port");
+    if (!reconnect.probe_port)
+      reconnect.probe_port = settings_opt_get_int("ssl") ? 5223 : 5222;
+  }
+
+  reconnect_set_state(reconnect_probing);
+  reconnect.probe_timer = g_timeout_add_seconds(RECONNECT_PROBE_TIMEOUT,
+                                                reconnect_probe_timeout,
+                                                NULL);
+
+  resolver = g_resolver_get_default();
+  reconnect.probe_resolve = g_cancellable_new();
+  g_resolver_lookup_by_name_async(resolver, host, reconnect.probe_resolve,
+                                  reconnect_probe_resolved, NULL);
+  g_object_unref(resolver);
+  g_free(host);
+}
+
+static gboolean reconnect_timeout(gpointer data)
+{
+  reconnect.source = 0;
+  if (lconnection)
+    reconnect_set_state(reconnect_idle);
+  else
+    reconnect_probe();
   return FALSE;
 }
 
+//  reconnect_schedule()
+// Schedule the next connection attempt.
+static void reconnect_schedule(void)
+{
+  glong delay, base;
+
+  if (reconnect.source)
+    return;
+
+  base = RECONNECT_DELAY_MIN << MIN(reconnect.failures, 8);
+  if (base > RECONNECT_DELAY_MAX)
+    base = RECONNECT_DELAY_MAX;
+  delay = base / 2 + (random() % (base / 2 + 1));
+  reconnect.failures++;
+  reconnect.when = time(NULL) + delay;
+  reconnect.source = g_timeout_add_seconds(delay, reconnect_timeout, NULL);
+  reconnect_set_state(reconnect_waiting);
+  scr_LogPrint(LPRINT_LOGNORM, "Reconnecting in %ld seconds (attempt #%u).",
+               delay, reconnect.failures);
+}
+
+//  xmpp_reconnect_cancel()
+// Cancel the pending reconnection, if any, and reset the backoff delay.
+void xmpp_reconnect_cancel(void)
+{
+  if (reconnect.source)
+    g_source_remove(reconnect.source);
+  reconnect.source = 0;
+  reconnect_probe_stop();
+  reconnect.failures = 0;
+  if (reconnect.state != reconnect_idle)
+    reconnect_set_state(reconnect_idle);
+}
+
+//  xmpp_reconnect_status()
+// Return a short description of the reconnection state, or NULL.
+const char *xmpp_reconnect_status(void)
+{
+  static char buf[64];
+  struct tm *lt;
+
+  switch (reconnect.state) {
+    case reconnect_waiting:
+        lt = localtime(&reconnect.when);
+        snprintf(buf, sizeof(buf), "retry #%u at %02d:%02d:%02d",
+                 reconnect.failures, lt->tm_hour, lt->tm_min, lt->tm_sec);
+        return buf;
+    case reconnect_probing:
+        return "probing server";
+    case reconnect_connecting:
+        return "connecting";
+    default:
+        return NULL;
+  }
+}
+
 static void _try_to_reconnect(void)
 {
   xmpp_disconnect();
   if (AutoConnection)
-    g_timeout_add_seconds(RECONNECTION_TIMEOUT + (random() % 90L),
-                          xmpp_reconnect, NULL);
+    reconnect_schedule();
+  else if (reconnect.state != reconnect_idle)
+    reconnect_set_state(reconnect_idle);
 }
 
 static void connection_open_cb(LmConnection *connection, gboolean success,
@@ -864,15 +1315,29 @@ static void connection_close_cb(LmConnection *connection,
           break;
   }
 
+  csi_reset();
+  bootstrap_reset();
+
   if (reason != LM_DISCONNECT_REASON_OK)
     _try_to_reconnect();
 
+  // Pending caps queries will not be answered
+  caps_queries_reset();
+  // Drop the presences we have not processed yet
+  presences_reset();
+  // ...and the stanzas we have not sent
+  sendq_reset();
+  // Forget the rooms we have not joined yet
+  muc_join_reset();
   // Free bookmarks
   if (bookmarks)
     lm_message_node_unref(bookmarks);
   bookmarks = NULL;
-  // Free roster
+  // Free roster, and reload the roster cache (if any) so that the
+  // roster is still available while we're offline
+  roster_cache_save();
   roster_free();
+  roster_cache_load();
   if (rosternotes)
     lm_message_node_unref(rosternotes);
   rosternotes = NULL;
@@ -1021,6 +1486,11 @@ static void gotmessage(LmMessageSubType type, const char *from,
   }
 #endif
 
+  // Drop the room history lines we already have
+  if (type == LM_MESSAGE_SUB_TYPE_GROUPCHAT && !subject &&
+      muc_message_seen(bjid, rname, body, timestamp))
+    goto gotmessage_return;
+
   { // format and pass message for further processing
     gchar *fullbody = NULL;
     guint encrypted;
@@ -1067,6 +1537,9 @@ static LmHandlerResult handle_messages(LmMessageHandler *handler,
   gboolean skip_process = FALSE;
   LmMessageNode *ns_signed = NULL;
 
+  // Keep the stanza order: pending presences first
+  xmpp_flush_presences();
+
   mstype = lm_message_get_sub_type(m);
 
   body = lm_message_node_get_child_value(m->node, "body");
@@ -1246,7 +1719,7 @@ static LmHandlerResult handle_messages(LmMessageHandler *handler,
     y = lm_message_node_add_child(rcvd->node, "received", NULL);
     lm_message_node_set_attribute(y, "xmlns", NS_RECEIPTS);
     lm_message_node_set_attribute(y, "id", mid);
-    lm_connection_send(connection, rcvd, NULL);
+    sendq_send(rcvd);
     lm_message_unref(rcvd);
   }
 
@@ -1298,6 +1771,156 @@ handle_messages_return:
   return LM_HANDLER_RESULT_REMOVE_MESSAGE;
 }
 
+/* ### XEP-0115 disco#info queries ### */
+
+// Only one disco#info query is sent for a given caps hash.  The other
+// contacts which advertise the same caps while the query is in progress
+// are kept as waiters, and one of them is asked if the query fails or
+// times out.
+typedef struct {
+  gchar *key;         // "ver,hash"
+  gchar *node;        // "node#ver"
+  gchar *queried;     // Full jid the query has been sent to
+  GSList *waiters;    // Other full jids with the same caps
+  guint timer;
+  gboolean inflight;  // FALSE while the query is in the backlog
+} caps_query;
+
+static GHashTable *caps_queries;    // "ver,hash" -> caps_query
+static GQueue caps_queries_backlog = G_QUEUE_INIT;
+static guint caps_queries_inflight;
+
+static LmHandlerResult cb_caps(LmMessageHandler *h, LmConnection *c,
+                               LmMessage *m, gpointer user_data);
+static void caps_query_next(caps_query *q);
+
+static void caps_query_free(gpointer data)
+{
+  caps_query *q = data;
+
+  if (q->timer)
+    g_source_remove(q->timer);
+  g_free(q->key);
+  g_free(q->node);
+  g_free(q->queried);
+  g_slist_free_full(q->waiters, g_free);
+  g_free(q);
+}
+
+static gboolean caps_query_timeout(gpointer data)
+{
+  caps_query *q = data;
+
+  q->timer = 0;
+  caps_query_next(q);
+  return FALSE;
+}
+
+//  caps_query_send(q)
+// Send the disco#info query to the first waiter.
+static void caps_query_send(caps_query *q)
+{
+  LmMessage *iq;
+  LmMessageHandler *handler;
+  GSList *first = q->waiters;
+
+  g_free(q->queried);
+  q->queried = first->data;
+  q->waiters = g_slist_delete_link(q->waiters, first);
+
+  iq = lm_message_new_with_sub_type(q->queried, LM_MESSAGE_TYPE_IQ,
+                                    LM_MESSAGE_SUB_TYPE_GET);
+  lm_message_node_set_attributes
+          (lm_message_node_add_child(iq->node, "query", NULL),
+           "xmlns", NS_DISCO_INFO,
+           "node", q->node,
+           NULL);
+  handler = lm_message_handler_new(cb_caps, g_strdup(q->key), NULL);
+  sendq_send_with_reply(iq, handler, NULL);
+  lm_message_unref(iq);
+  lm_message_handler_unref(handler);
+
+  q->timer = g_timeout_add_seconds(CAPS_QUERY_TIMEOUT, caps_query_timeout, q);
+}
+
+//  caps_query_done(q)
+// Forget the query and start the next one from the backlog.
+static void caps_query_done(caps_query *q)
+{
+  g_hash_table_remove(caps_queries, q->key);
+  caps_queries_inflight--;
+
+  while (caps_queries_inflight < CAPS_QUERIES_MAX) {
+    caps_query *next = g_queue_pop_head(&caps_queries_backlog);
+    if (!next)
+      break;
+    caps_queries_inflight++;
+    next->inflight = TRUE;
+    caps_query_send(next);
+  }
+}
+
+//  caps_query_next(q)
+// The current query has failed: ask the next waiter, if any.
+static void caps_query_next(caps_query *q)
+{
+  if (q->timer) {
+    g_source_remove(q->timer);
+    q->timer = 0;
+  }
+  if (q->waiters)
+    caps_query_send(q);
+  else
+    caps_query_done(q);
+}
+
+//  caps_request(fjid, node, ver, hash)
+// Ask fjid for the features matching the caps ver/hash, unless this is
+// already in progress.
+static void caps_request(const char *fjid, const char *node,
+                         const char *ver, const char *hash)
+{
+  caps_query *q;
+  gchar *key = g_strdup_printf("%s,%s", ver, hash);
+
+  if (!caps_queries)
+    caps_queries = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                         NULL, caps_query_free);
+
+  q = g_hash_table_lookup(caps_queries, key);
+  if (q) {
+    g_free(key);
+    if (g_strcmp0(q->queried, fjid) &&
+        !g_slist_find_custom(q->waiters, fjid, (GCompareFunc)strcmp))
+      q->waiters = g_slist_append(q->waiters, g_strdup(fjid));
+    return;
+  }
+
+  q = g_new0(caps_query, 1);
+  q->key = key;
+  q->node = g_strdup_printf("%s#%s", node, ver);
+  q->waiters = g_slist_append(NULL, g_strdup(fjid));
+  g_hash_table_insert(caps_queries, q->key, q);
+
+  if (caps_queries_inflight < CAPS_QUERIES_MAX) {
+    caps_queries_inflight++;
+    q->inflight = TRUE;
+    caps_query_send(q);
+  } else {
+    g_queue_push_tail(&caps_queries_backlog, q);
+  }
+}
+
+//  caps_queries_reset()
+// Drop all the queries (the replies will be ignored).
+static void caps_queries_reset(void)
+{
+  g_queue_clear(&caps_queries_backlog);
+  if (caps_queries)
+    g_hash_table_remove_all(caps_queries);
+  caps_queries_inflight = 0;
+}
+
 static LmHandlerResult cb_caps(LmMessageHandler *h, LmConnection *c,
                                LmMessage *m, gpointer user_data)
 {
@@ -1306,6 +1929,18 @@ static LmHandlerResult cb_caps(LmMessageHandler *h, LmConnection *c,
   const char *from = lm_message_get_from(m);
   char *bjid = jidtodisp(from);
   LmMessageSubType mstype = lm_message_get_sub_type(m);
+  caps_query *q = NULL;
+  gboolean current;
+
+  // Look for the query before ver is split.  A query with the same ver
+  // may have been created again since, and still be in the backlog.
+  if (caps_queries)
+    q = g_hash_table_lookup(caps_queries, ver);
+  if (q && !q->inflight)
+    q = NULL;
+  // A late reply from a contact we asked earlier can still be a good one,
+  // but a failure is only taken into account for the current request.
+  current = q && !g_strcmp0(q->queried, from);
 
   hash = strchr(ver, ',');
   if (hash)
@@ -1315,8 +1950,13 @@ static LmHandlerResult cb_caps(LmMessageHandler *h, LmConnection *c,
     LmMessageNode *info;
     LmMessageNode *query = lm_message_node_get_child(m->node, "query");
 
-    if (caps_has_hash(ver, bjid) || !query)
+    if (caps_has_hash(ver, bjid) || !query) {
+      if (q && caps_has_hash(ver, NULL))
+        caps_query_done(q);
+      else if (current)
+        caps_query_next(q);
       goto caps_callback_return;
+    }
 
     caps_add(ver);
 
@@ -1387,10 +2027,19 @@ static LmHandlerResult cb_caps(LmMessageHandler *h, LmConnection *c,
       }
     }
 
-    if (caps_verify(ver, hash))
+    if (caps_verify(ver, hash)) {
       caps_copy_to_persistent(ver, lm_message_node_to_string(query));
-    else
+      // The waiters share these caps
+      if (q)
+        caps_query_done(q);
+    } else {
       caps_move_to_local(ver, bjid);
+      // We cannot trust this reply for the others
+      if (current)
+        caps_query_next(q);
+    }
+  } else if (current) {
+    caps_query_next(q);
   }
 
 caps_callback_return:
@@ -1399,9 +2048,8 @@ caps_callback_return:
   return LM_HANDLER_RESULT_REMOVE_MESSAGE;
 }
 
-static LmHandlerResult handle_presence(LmMessageHandler *handler,
-                                       LmConnection *connection,
-                                       LmMessage *m, gpointer user_data)
+static LmHandlerResult presence_process(LmConnection *connection,
+                                        LmMessage *m)
 {
   char *bjid;
   const char *from, *rname, *p=NULL, *ustmsg=NULL;
@@ -1429,13 +2077,6 @@ static LmHandlerResult handle_presence(LmMessageHandler *handler,
   rname = strchr(from, JID_RESOURCE_SEPARATOR);
   if (rname) rname++;
 
-  if (settings_opt_get_int("ignore_self_presence")) {
-    const char *self_fjid = lm_connection_get_jid(connection);
-    if (self_fjid && !strcasecmp(self_fjid, from)) {
-      return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS; // Ignoring self presence
-    }
-  }
-
   bjid = jidtodisp(from);
 
   if (mstype == LM_MESSAGE_SUB_TYPE_ERROR) {
@@ -1454,6 +2095,8 @@ static LmHandlerResult handle_presence(LmMessageHandler *handler,
           buddy_setnickname(room_elt->data, NULL);
       }
     }
+    // This may be the answer to a join request
+    muc_join_done(bjid);
 
     g_free(bjid);
     return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
@@ -1534,27 +2177,9 @@ static LmHandlerResult handle_presence(LmMessageHandler *handler,
     if (sl_buddy && buddy_getonserverflag(sl_buddy->data)) {
       buddy_resource_setcaps(sl_buddy->data, rname, ver);
 
-      if (!caps_has_hash(ver, bjid) && !caps_restore_from_persistent(ver)) {
-        char *node;
-        LmMessageHandler *handler;
-        LmMessage *iq = lm_message_new_with_sub_type(from, LM_MESSAGE_TYPE_IQ,
-                                                     LM_MESSAGE_SUB_TYPE_GET);
-        node = g_strdup_printf("%s#%s",
-                               lm_message_node_get_attribute(caps, "node"),
-                               ver);
-        lm_message_node_set_attributes
-                (lm_message_node_add_child(iq->node, "query", NULL),
-                 "xmlns", NS_DISCO_INFO,
-                 "node", node,
-                 NULL);
-        g_free(node);
-        handler = lm_message_handler_new(cb_caps,
-                                         g_strdup_printf("%s,%s",ver,hash),
-                                         NULL);
-        lm_connection_send_with_reply(connection, iq, handler, NULL);
-        lm_message_unref(iq);
-        lm_message_handler_unref(handler);
-      }
+      if (!caps_has_hash(ver, bjid) && !caps_restore_from_persistent(ver))
+        caps_request(from, lm_message_node_get_attribute(caps, "node"),
+                     ver, hash);
     }
   }
 
@@ -1563,6 +2188,105 @@ handle_presence_return:
   return LM_HANDLER_RESULT_REMOVE_MESSAGE;
 }
 
+/* Presence batches
+ * Presence packets are not processed as soon as they are received but
+ * queued until the end of the main loop iteration (or until another kind
+ * of stanza arrives), so that a storm (e.g. when joining a large room) is
+ * applied to the roster in one go.  Only the latest presence of a given
+ * full JID is kept.
+ */
+static struct {
+  GQueue queue;         // Pending presence packets, in arrival order
+  GHashTable *last;     // Full JID -> queue link of its latest presence
+  LmConnection *connection;
+  guint coalesced;      // Packets superseded by a later presence
+} presences = { G_QUEUE_INIT, NULL, NULL, 0 };
+
+//  xmpp_flush_presences()
+// Process the pending presence packets.
+void xmpp_flush_presences(void)
+{
+  LmMessage *m;
+
+  if (g_queue_is_empty(&presences.queue))
+    return;
+
+  g_hash_table_remove_all(presences.last);
+  hk_presence_batch_begin(g_queue_get_length(&presences.queue),
+                          presences.coalesced);
+  presences.coalesced = 0;
+  while ((m = g_queue_pop_head(&presences.queue)) != NULL) {
+    presence_process(presences.connection, m);
+    lm_message_unref(m);
+  }
+  hk_presence_batch_end();
+}
+
+static void presences_reset(void)
+{
+  LmMessage *m;
+
+  while ((m = g_queue_pop_head(&presences.queue)) != NULL)
+    lm_message_unref(m);
+  if (presences.last)
+    g_hash_table_remove_all(presences.last);
+  presences.coalesced = 0;
+}
+
+static LmHandlerResult handle_presence(LmMessageHandler *handler,
+                                       LmConnection *connection,
+                                       LmMessage *m, gpointer user_data)
+{
+  const char *from = lm_message_get_from(m);
+  LmMessageSubType mstype = lm_message_get_sub_type(m);
+  GList *link;
+
+  if (from && settings_opt_get_int("ignore_self_presence")) {
+    const char *self_fjid = lm_connection_get_jid(connection);
+    if (self_fjid && !strcasecmp(self_fjid, from)) {
+      return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS; // Ignoring self presence
+    }
+  }
+
+  // Errors and unexpected packets are not queued
+  if (!from || mstype == LM_MESSAGE_SUB_TYPE_ERROR) {
+    xmpp_flush_presences();
+    return presence_process(connection, m);
+  }
+
+  if (!presences.last)
+    presences.last = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                           g_free, NULL);
+  presences.connection = connection;
+
+  // Subscription requests and replies are queued as they are
+  if (mstype != LM_MESSAGE_SUB_TYPE_NOT_SET &&
+      mstype != LM_MESSAGE_SUB_TYPE_AVAILABLE &&
+      mstype != LM_MESSAGE_SUB_TYPE_UNAVAILABLE) {
+    g_queue_push_tail(&presences.queue, lm_message_ref(m));
+    goto handle_presence_return;
+  }
+
+  link = g_hash_table_lookup(presences.last, from);
+  // An unavailable presence is never dropped, so that a leave followed
+  // by a join is still reported.
+  if (link && lm_message_get_sub_type(link->data) !=
+      LM_MESSAGE_SUB_TYPE_UNAVAILABLE) {
+    lm_message_unref(link->data);
+    g_queue_delete_link(&presences.queue, link);
+    presences.coalesced++;
+  }
+  g_queue_push_tail(&presences.queue, lm_message_ref(m));
+  g_hash_table_replace(presences.last, g_strdup(from),
+                       g_queue_peek_tail_link(&presences.queue));
+
+handle_presence_return:
+  if (g_queue_get_length(&presences.queue) >= PRESENCE_BATCH_MAX)
+    xmpp_flush_presences();
+
+  return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+}
+
 
 static LmHandlerResult handle_iq(LmMessageHandler *handler,
                                  LmConnection *connection,
@@ -1574,6 +2298,8 @@ static LmHandlerResult handle_iq(LmMessageHandler *handler,
   LmMessageNode *x;
   LmMessageSubType mstype = lm_message_get_sub_type(m);
 
+  xmpp_flush_presences();
+
   if (mstype == LM_MESSAGE_SUB_TYPE_ERROR) {
     display_server_error(lm_message_node_get_child(m->node, "error"),
                          lm_message_get_from(m));
@@ -1816,6 +2542,8 @@ gint xmpp_connect(void)
   lm_connection_set_disconnect_function(lconnection, connection_close_cb,
                                         NULL, NULL);
 
+  csi_register_handlers(lconnection);
+
   handler = lm_message_handler_new(handle_messages, NULL, NULL);
   lm_connection_register_message_handler(lconnection, handler,
                                          LM_MESSAGE_TYPE_MESSAGE,
@@ -1951,6 +2679,7 @@ gint xmpp_connect(void)
     return -1;
   }
 
+  gettimeofday(&connect_time, NULL);
   if (!lm_connection_open(lconnection, connection_open_cb,
                           NULL, FALSE, &error)) {
     _try_to_reconnect();
@@ -1986,6 +2715,8 @@ void xmpp_disconnect(void)
     // Announce it to  everyone else
     xmpp_setstatus(offline, NULL, "", FALSE);
   }
+  // Do not lose the last stanzas
+  sendq_flush(TRUE);
   if (lm_connection_is_open(lconnection))
     lm_connection_close(lconnection, NULL);
   lm_connection_unref(lconnection);
@@ -2058,7 +2789,7 @@ void xmpp_setstatus(enum imstatus st, const char *recipient, const char *msg,
       }
     }
 #endif
-    lm_connection_send(lconnection, m, NULL);
+    sendq_send(m);
     lm_message_unref(m);
   }
 
@@ -2137,7 +2868,7 @@ void send_storage(LmMessageNode *store)
   lm_message_node_insert_childnode(query, store);
 
   handler = lm_message_handler_new(handle_iq_dummy, NULL, FALSE);
-  lm_connection_send_with_reply(lconnection, iq, handler, NULL);
+  sendq_send_with_reply(iq, handler, NULL);
   lm_message_handler_unref(handler);
   lm_message_unref(iq);
 }
@@ -37,6 +37,8 @@ extern LmSSL* lssl;
 
 int  xmpp_connect(void);
 void xmpp_disconnect(void);
+void xmpp_reconnect_cancel(void);
+const char *xmpp_reconnect_status(void);
 gboolean xmpp_is_online(void);
 
 void xmpp_room_join(const char *room, const char *nickname, const char *passwd);
@@ -65,6 +67,7 @@ void xmpp_setstatus(enum imstatus st, const char *recipient,
                     const char *msg, int do_not_sign);
 
 void xmpp_send_chatstate(gpointer buddy, guint chatstate);
+void xmpp_flush_presences(void);
 
 void xmpp_insert_entity_capabilities(LmMessageNode *x, enum imstatus status);
 
@@ -87,6 +90,17 @@ void xmpp_request(const char *fjid, enum iqreq_type reqtype);
 void request_vcard(const char *bjid);
 void xmpp_request_storage(const gchar *storage);
 
+// Post-login requests (see xmpp_bootstrap_done())
+#define BOOTSTRAP_ROSTER      (1U<<0)
+#define BOOTSTRAP_DISCO       (1U<<1)
+#define BOOTSTRAP_BOOKMARKS   (1U<<2)
+#define BOOTSTRAP_ROSTERNOTES (1U<<3)
+
+void xmpp_bootstrap_done(guint request);
+void xmpp_bootstrap_failed(guint request);
+gboolean xmpp_bootstrap_defer_join(const char *room, const char *nick,
+                                   const char *passwd);
+
 #endif /* __MCABBER_XMPP_H__ */
 
 /* vim: set et cindent cinoptions=>2\:2(0 ts=2 sw=2:  For Vim users... */
@@ -63,6 +63,7 @@
 
 #define NS_CARBONS_2  "urn:xmpp:carbons:2" // XEP-0280 (message carbons)
 #define NS_FORWARD    "urn:xmpp:forward:0" // XEP-0297 (stanza forwarding)
+#define NS_CSI        "urn:xmpp:csi:0"     // XEP-0352 (client state indication)
 
 #define NS_JABBERD_STOREDPRESENCE "http://jabberd.org/ns/storedpresence"
 #define NS_JABBERD_HISTORY "http://jabberd.org/ns/history"
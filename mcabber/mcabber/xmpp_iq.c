@@ -34,6 +34,7 @@
 #include "settings.h"
 #include "caps.h"
 #include "main.h"
+#include "sendq.h"
 
 extern struct xmpp_error xmpp_errors[];
 
@@ -127,7 +128,7 @@ void send_iq_error(LmConnection *c, LmMessage *m, guint error)
   LmMessage *r;
   r = lm_message_new_iq_error(m, error);
   if (r) {
-    lm_connection_send(c, r, NULL);
+    sendq_send(r);
     lm_message_unref(r);
   }
 }
@@ -196,7 +197,7 @@ static LmHandlerResult handle_iq_commands_list(LmMessageHandler *h,
     }
   }
 
-  lm_connection_send(c, iq, NULL);
+  sendq_send(iq);
   lm_message_unref(iq);
   return LM_HANDLER_RESULT_REMOVE_MESSAGE;
 }
@@ -306,7 +307,7 @@ static LmHandlerResult handle_iq_command_set_status(LmMessageHandler *h,
   }
   if (sessionid)
     lm_message_node_set_attribute(command, "sessionid", sessionid);
-  lm_connection_send(c, iq, NULL);
+  sendq_send(iq);
   lm_message_unref(iq);
   return LM_HANDLER_RESULT_REMOVE_MESSAGE;
 }
@@ -423,7 +424,7 @@ static LmHandlerResult handle_iq_command_leave_groupchats(LmMessageHandler *h,
   }
   if (sessionid)
     lm_message_node_set_attribute(command, "sessionid", sessionid);
-  lm_connection_send(c, iq, NULL);
+  sendq_send(iq);
   lm_message_unref(iq);
   return LM_HANDLER_RESULT_REMOVE_MESSAGE;
 }
@@ -470,7 +471,7 @@ LmHandlerResult handle_iq_commands(LmMessageHandler *h,
         lm_message_node_set_attribute
           (lm_message_node_add_child(err, "malformed-action", NULL),
            "xmlns", NS_COMMANDS);
-        lm_connection_send(c, r, NULL);
+        sendq_send(r);
         lm_message_unref(r);
       }
     }
@@ -569,7 +570,7 @@ LmHandlerResult handle_iq_disco_info(LmMessageHandler *h,
     // Basic discovery request
     disco_info_set_caps(query, NULL);
 
-  lm_connection_send(c, r, NULL);
+  sendq_send(r);
   lm_message_unref(r);
   return LM_HANDLER_RESULT_REMOVE_MESSAGE;
 }
@@ -577,15 +578,25 @@ LmHandlerResult handle_iq_disco_info(LmMessageHandler *h,
 LmHandlerResult handle_iq_roster(LmMessageHandler *h, LmConnection *c,
                                  LmMessage *m, gpointer ud)
 {
-  LmMessageNode *y;
-  const char *fjid, *name, *group, *sub, *ask;
+  LmMessageNode *x, *y;
+  const char *fjid, *name, *group, *sub, *ask, *ver;
   char *cleanalias;
   enum subscr esub;
   int need_refresh = FALSE;
   guint roster_type;
 
-  y = lm_message_node_find_child(lm_message_node_find_xmlns(m->node, NS_ROSTER),
-                                 "item");
+  x = lm_message_node_find_xmlns(m->node, NS_ROSTER);
+
+  // XEP-0237: Roster Versioning
+  // Roster pushes come with the new version; a full roster without
+  // version means the server doesn't support versioning.
+  if (x) {
+    ver = lm_message_node_get_attribute(x, "ver");
+    if (ver || lm_message_get_sub_type(m) == LM_MESSAGE_SUB_TYPE_RESULT)
+      roster_setversion(ver);
+  }
+
+  y = lm_message_node_find_child(x, "item");
   for ( ; y; y = y->next) {
     char *name_tmp = NULL;
 
@@ -652,7 +663,7 @@ LmHandlerResult handle_iq_roster(LmMessageHandler *h, LmConnection *c,
   if (lm_message_get_sub_type(m) == LM_MESSAGE_SUB_TYPE_SET) {
     LmMessage *result;
     result = lm_message_new_iq_from_query(m, LM_MESSAGE_SUB_TYPE_RESULT);
-    lm_connection_send(c, result, NULL);
+    sendq_send(result);
     lm_message_unref(result);
   }
 
@@ -669,7 +680,7 @@ LmHandlerResult handle_iq_ping(LmMessageHandler *h, LmConnection *c,
   LmMessage *r;
 
   r = lm_message_new_iq_from_query(m, LM_MESSAGE_SUB_TYPE_RESULT);
-  lm_connection_send(c, r, NULL);
+  sendq_send(r);
   lm_message_unref(r);
   return LM_HANDLER_RESULT_REMOVE_MESSAGE;
 }
@@ -706,7 +717,7 @@ LmHandlerResult handle_iq_last(LmMessageHandler *h, LmConnection *c,
   lm_message_node_set_attribute(query, "seconds", seconds);
   g_free(seconds);
 
-  lm_connection_send(c, r, NULL);
+  sendq_send(r);
   lm_message_unref(r);
   return LM_HANDLER_RESULT_REMOVE_MESSAGE;
 }
@@ -752,7 +763,7 @@ LmHandlerResult handle_iq_version(LmMessageHandler *h, LmConnection *c,
     g_free(os);
   }
 
-  lm_connection_send(c, r, NULL);
+  sendq_send(r);
   lm_message_unref(r);
   return LM_HANDLER_RESULT_REMOVE_MESSAGE;
 }
@@ -804,7 +815,7 @@ LmHandlerResult handle_iq_time(LmMessageHandler *h, LmConnection *c,
     g_free(utf8_buf);
   }
 
-  lm_connection_send(c, r, NULL);
+  sendq_send(r);
   lm_message_unref(r);
   g_free(buf);
   return LM_HANDLER_RESULT_REMOVE_MESSAGE;
@@ -869,7 +880,7 @@ LmHandlerResult handle_iq_time202(LmMessageHandler *h, LmConnection *c,
   strftime(buf, 512, "%Y-%m-%dT%TZ", now);
   lm_message_node_add_child(query, "utc", buf);
 
-  lm_connection_send(c, r, NULL);
+  sendq_send(r);
   lm_message_unref(r);
   g_free(buf);
   return LM_HANDLER_RESULT_REMOVE_MESSAGE;
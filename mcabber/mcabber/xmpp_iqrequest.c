@@ -26,12 +26,14 @@
 
 #include "xmpp_helper.h"
 #include "xmpp_iq.h"
+#include "xmpp_muc.h"
 #include "screen.h"
 #include "utils.h"
 #include "settings.h"
 #include "hooks.h"
 #include "hbuf.h"
 #include "carbons.h"
+#include "sendq.h"
 
 extern LmMessageNode *bookmarks;
 extern LmMessageNode *rosternotes;
@@ -97,6 +99,7 @@ static LmHandlerResult cb_disco_info(LmMessageHandler *h, LmConnection *c,
     }
   }
 
+  xmpp_bootstrap_done(BOOTSTRAP_DISCO);
   return LM_HANDLER_RESULT_REMOVE_MESSAGE;
 }
 
@@ -189,12 +192,21 @@ void xmpp_iq_request(const char *fulljid, const char *xmlns)
                                        settings_opt_get("server"));
     lm_message_node_set_attribute(iq->node, "to", servername);
     g_free(servername);
+  } else if (!g_strcmp0(xmlns, NS_ROSTER)) {
+    // XEP-0237: Roster Versioning
+    // Only supported with a roster cache, since the server will only
+    // send us the changes since our version.
+    if (settings_opt_get_int("roster_versioning") &&
+        settings_opt_get("roster_cache")) {
+      const char *ver = roster_getversion();
+      lm_message_node_set_attribute(query, "ver", ver ? ver : "");
+    }
   }
 
   handler = lm_message_handler_new(iq_request_handlers[i].handler,
                                    data, notifier);
 
-  lm_connection_send_with_reply(lconnection, iq, handler, &error);
+  sendq_send_with_reply(iq, handler, &error);
   lm_message_handler_unref(handler);
   lm_message_unref(iq);
 
@@ -213,19 +225,39 @@ static LmHandlerResult cb_roster(LmMessageHandler *h, LmConnection *c,
   const char *ns;
 
   // Only execute the hook if the roster has been successfully retrieved
-  if (lm_message_get_sub_type(m) != LM_MESSAGE_SUB_TYPE_RESULT)
+  if (lm_message_get_sub_type(m) != LM_MESSAGE_SUB_TYPE_RESULT) {
+    xmpp_bootstrap_failed(BOOTSTRAP_ROSTER);
     return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
+  }
 
   x = lm_message_node_find_child(m->node, "query");
-  if (!x)
-    return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
+  if (!x) {
+    // XEP-0237: An empty result means that our (cached) roster version
+    // is up to date.  The changes, if any, will be sent as roster pushes.
+    roster_cache_confirm();
+    buddylist_build();
+    update_roster = TRUE;
+    scr_LogPrint(LPRINT_DEBUG, "Roster is up to date (version %s)",
+                 roster_getversion());
+    xmpp_bootstrap_done(BOOTSTRAP_ROSTER);
+    return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+  }
 
   ns = lm_message_node_get_attribute(x, "xmlns");
-  if (ns && !strcmp(ns, NS_ROSTER))
+  if (ns && !strcmp(ns, NS_ROSTER)) {
+    guint nitems;
+    gsize nbytes;
     handle_iq_roster(NULL, c, m, user_data);
+    // Remove the cached items the server doesn't know about anymore
+    roster_cache_purge();
+    roster_memusage(&nitems, &nbytes);
+    scr_LogPrint(LPRINT_DEBUG, "Roster: %u items, %lu bytes (%lu per item)",
+                 nitems, (unsigned long)nbytes,
+                 (unsigned long)(nitems ? nbytes / nitems : 0));
+  }
 
-  // Post-login stuff
-  hk_postconnect();
+  // The post-login stuff is done once the session is usable
+  xmpp_bootstrap_done(BOOTSTRAP_ROSTER);
 
   return LM_HANDLER_RESULT_REMOVE_MESSAGE;
 }
@@ -665,15 +697,12 @@ static void storage_bookmarks_parse_conference(LmMessageNode *node)
     passwd = lm_message_node_get_child_value(node, "password");
     if (!nick || !*nick)
       nick = tmpnick = default_muc_nickname(NULL);
-    // Let's join now
-    scr_LogPrint(LPRINT_LOGNORM, "Auto-join bookmark <%s>", bjid);
-    xmpp_room_join(bjid, nick, passwd);
+    // Let's join now, or when the login is complete
+    if (!xmpp_bootstrap_defer_join(bjid, nick, passwd))
+      xmpp_room_join_queued(bjid, nick, passwd);
     g_free(tmpnick);
   }
   g_free(bjid);
-
-  buddylist_build();
-  update_roster = TRUE;
 }
 
 static LmHandlerResult cb_storage_bookmarks(LmMessageHandler *h,
@@ -698,6 +727,7 @@ static LmHandlerResult cb_storage_bookmarks(LmMessageHandler *h,
       // not displayed, as it isn't a real error.
     } else
       scr_LogPrint(LPRINT_LOGNORM, "Server does not support bookmarks storage.");
+    xmpp_bootstrap_done(BOOTSTRAP_BOOKMARKS);
     return LM_HANDLER_RESULT_REMOVE_MESSAGE;
   }
 
@@ -705,6 +735,7 @@ static LmHandlerResult cb_storage_bookmarks(LmMessageHandler *h,
   ansqry = lm_message_node_get_child(ansqry, "storage");
   if (!ansqry) {
     scr_LogPrint(LPRINT_LOG, "Invalid IQ:private result! (storage:bookmarks)");
+    xmpp_bootstrap_done(BOOTSTRAP_BOOKMARKS);
     return 0;
   }
 
@@ -714,11 +745,14 @@ static LmHandlerResult cb_storage_bookmarks(LmMessageHandler *h,
     if (x->name && !strcmp(x->name, "conference"))
       storage_bookmarks_parse_conference(x);
   }
+  buddylist_build();
+  update_roster = TRUE;
   // "Copy" the bookmarks node
   if (bookmarks)
     lm_message_node_unref(bookmarks);
   lm_message_node_deep_ref(ansqry);
   bookmarks = ansqry;
+  xmpp_bootstrap_done(BOOTSTRAP_BOOKMARKS);
   return 0;
 }
 
@@ -745,6 +779,7 @@ static LmHandlerResult cb_storage_rosternotes(LmMessageHandler *h,
       // not displayed, as it isn't a real error.
     } else
       scr_LogPrint(LPRINT_LOGNORM, "Server does not support roster notes storage.");
+    xmpp_bootstrap_done(BOOTSTRAP_ROSTERNOTES);
     return LM_HANDLER_RESULT_REMOVE_MESSAGE;
   }
 
@@ -753,6 +788,7 @@ static LmHandlerResult cb_storage_rosternotes(LmMessageHandler *h,
   if (!ansqry) {
     scr_LogPrint(LPRINT_LOG, "Invalid IQ:private result! "
                  "(storage:rosternotes)");
+    xmpp_bootstrap_done(BOOTSTRAP_ROSTERNOTES);
     return LM_HANDLER_RESULT_REMOVE_MESSAGE;
   }
   // Copy the rosternotes node
@@ -760,6 +796,7 @@ static LmHandlerResult cb_storage_rosternotes(LmMessageHandler *h,
     lm_message_node_unref(rosternotes);
   lm_message_node_deep_ref(ansqry);
   rosternotes = ansqry;
+  xmpp_bootstrap_done(BOOTSTRAP_ROSTERNOTES);
   return 0;
 }
 
@@ -795,7 +832,7 @@ void xmpp_request_storage(const gchar *storage)
 
   handler = lm_message_handler_new(iq_request_storage_handlers[i].handler,
                                    NULL, FALSE);
-  lm_connection_send_with_reply(lconnection, iq, handler, NULL);
+  sendq_send_with_reply(iq, handler, NULL);
   lm_message_handler_unref(handler);
   lm_message_unref(iq);
 }
@@ -23,6 +23,7 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "xmpp_helper.h"
 #include "xmpp_iq.h"
@@ -36,12 +37,54 @@
 #include "settings.h"
 #include "utils.h"
 #include "histolog.h"
+#include "sendq.h"
 
 extern enum imstatus mystatus;
 extern gchar *mystatusmsg;
 
+#define DEFAULT_MUC_JOIN_WINDOW 4   // Room joins in progress at the same time
+#define MUC_JOIN_TIMEOUT        20  // Seconds
+
+#define MUC_SEEN_SIZE     256   // Recent messages remembered per room
+#define MUC_SEEN_SLACK    120   // Seconds, our timestamps are not the room's
+#define MUC_SEEN_REPORT   3     // Seconds without duplicates before reporting
+
 static GSList *invitations = NULL;
 
+struct muc_join {
+  gchar *room;
+  gchar *nick;
+  gchar *passwd;
+  time_t last;    // Last logged message
+  guint timer;
+};
+
+// Recent messages of a room, to detect the history lines we already have
+struct muc_seen {
+  struct {
+    guint hash;     // "<nick> message" or "*nick action" (see muc_seen_hash)
+    time_t timestamp;
+    guint replay;   // Join number, if the message comes from a history replay
+  } msg[MUC_SEEN_SIZE];
+  guint next;
+  guint joins;      // Number of times we have joined the room
+  const char *room; // Hash table key
+  guint dropped;    // Duplicates not reported yet
+  guint report;
+};
+
+static GHashTable *muc_seen_rooms;  // Lowercase room JID -> struct muc_seen
+static gulong muc_seen_dropped;
+
+// Join scheduler
+static struct {
+  GQueue pending;     // Rooms to join, most recently active first
+  GSList *inflight;   // Joins sent, waiting for the room presence
+  guint sent;
+  time_t start;
+  guint idle;
+} joins = { G_QUEUE_INIT, NULL, 0, 0, 0 };
+
 static void decline_invitation(event_muc_invitation *invitation, const char *reason)
 {
   // cut and paste from xmpp_room_invite
@@ -62,7 +105,7 @@ static void decline_invitation(event_muc_invitation *invitation, const char *rea
   if (reason)
     lm_message_node_add_child(y, "reason", reason);
 
-  lm_connection_send(lconnection, m, NULL);
+  sendq_send(m);
   lm_message_unref(m);
 }
 
@@ -116,6 +159,34 @@ static gboolean evscallback_invitation(guint evcontext, const char *arg, gpointe
   return FALSE;
 }
 
+//  muc_add_history_request(x, room)
+// Limit the discussion history sent by the room.  If the room is logged,
+// we only ask for the messages we have not logged yet.
+static void muc_add_history_request(LmMessageNode *x, const char *room)
+{
+  int maxstanzas = settings_opt_get_int("muc_history_maxstanzas");
+  time_t last = 0;
+  LmMessageNode *h;
+
+  if (settings_opt_get_int("log_muc_conf"))
+    last = hlog_get_last_timestamp(room);
+  if (!last && maxstanzas <= 0)
+    return;
+
+  h = lm_message_node_add_child(x, "history", NULL);
+  if (last) {
+    char since[32];
+    last++;
+    strftime(since, sizeof(since), "%Y-%m-%dT%H:%M:%SZ", gmtime(&last));
+    lm_message_node_set_attribute(h, "since", since);
+  }
+  if (maxstanzas > 0) {
+    gchar *ms = g_strdup_printf("%d", maxstanzas);
+    lm_message_node_set_attribute(h, "maxstanzas", ms);
+    g_free(ms);
+  }
+}
+
 // Join a MUC room
 void xmpp_room_join(const char *room, const char *nickname, const char *passwd)
 {
@@ -123,6 +194,7 @@ void xmpp_room_join(const char *room, const char *nickname, const char *passwd)
   LmMessageNode *y;
   gchar *roomid;
   GSList *room_elt;
+  gboolean joining = FALSE;
 
   if (!xmpp_is_online() || !room)
     return;
@@ -149,6 +221,7 @@ void xmpp_room_join(const char *room, const char *nickname, const char *passwd)
   if (!buddy_getinsideroom(room_elt->data)) {
     // We're trying to enter a room
     buddy_setnickname(room_elt->data, nickname);
+    joining = TRUE;
   }
 
   // Send the XML request
@@ -158,12 +231,285 @@ void xmpp_room_join(const char *room, const char *nickname, const char *passwd)
   lm_message_node_set_attribute(y, "xmlns", NS_MUC);
   if (passwd)
     lm_message_node_add_child(y, "password", passwd);
+  if (joining)
+    muc_add_history_request(y, room);
 
-  lm_connection_send(lconnection, x, NULL);
+  sendq_send(x);
   lm_message_unref(x);
   g_free(roomid);
 }
 
+static void muc_join_free(struct muc_join *mj)
+{
+  if (mj->timer)
+    g_source_remove(mj->timer);
+  g_free(mj->room);
+  g_free(mj->nick);
+  g_free(mj->passwd);
+  g_free(mj);
+}
+
+// Most recently active rooms first, and in order of arrival
+static gint muc_join_cmp(gconstpointer a, gconstpointer b, gpointer data)
+{
+  const struct muc_join *mja = a, *mjb = b;
+  return (mja->last >= mjb->last ? -1 : 1);
+}
+
+static gint muc_join_find(gconstpointer a, gconstpointer b)
+{
+  return strcasecmp(((const struct muc_join *)a)->room, b);
+}
+
+static void muc_join_next(void);
+
+static gboolean muc_join_timeout(gpointer data)
+{
+  struct muc_join *mj = data;
+
+  mj->timer = 0;
+  scr_LogPrint(LPRINT_DEBUG, "No answer from <%s> yet, "
+               "joining the next room.", mj->room);
+  joins.inflight = g_slist_remove(joins.inflight, mj);
+  muc_join_free(mj);
+  muc_join_next();
+  return FALSE;
+}
+
+//  muc_join_next()
+// Send the pending joins, as long as the window is not full.
+static void muc_join_next(void)
+{
+  const char *p = settings_opt_get("muc_join_window");
+  int window = p ? atoi(p) : DEFAULT_MUC_JOIN_WINDOW;
+  struct muc_join *mj;
+
+  while (!g_queue_is_empty(&joins.pending) &&
+         (window <= 0 || g_slist_length(joins.inflight) < (guint)window)) {
+    mj = g_queue_pop_head(&joins.pending);
+    scr_LogPrint(LPRINT_LOGNORM, "Auto-join bookmark <%s>", mj->room);
+    xmpp_room_join(mj->room, mj->nick, mj->passwd);
+    joins.sent++;
+    if (window <= 0) {
+      muc_join_free(mj);
+      continue;
+    }
+    mj->timer = g_timeout_add_seconds(MUC_JOIN_TIMEOUT, muc_join_timeout, mj);
+    joins.inflight = g_slist_prepend(joins.inflight, mj);
+  }
+
+  if (joins.sent && !joins.inflight && g_queue_is_empty(&joins.pending)) {
+    scr_LogPrint(LPRINT_LOGNORM, "%u room%s joined in %ld s.", joins.sent,
+                 joins.sent > 1 ? "s" : "", (long)(time(NULL) - joins.start));
+    joins.sent = 0;
+  }
+}
+
+static gboolean muc_join_idle(gpointer data)
+{
+  joins.idle = 0;
+  muc_join_next();
+  return FALSE;
+}
+
+//  xmpp_room_join_queued(room, nickname, passwd)
+// Schedule a room join (for bookmark autojoin).  The rooms are joined a few
+// at a time (see the muc_join_window option), the most recently active
+// rooms first.
+void xmpp_room_join_queued(const char *room, const char *nickname,
+                           const char *passwd)
+{
+  struct muc_join *mj;
+
+  if (!room || !nickname)
+    return;
+  if (g_queue_find_custom(&joins.pending, room, muc_join_find) ||
+      g_slist_find_custom(joins.inflight, room, muc_join_find))
+    return;
+
+  mj = g_new0(struct muc_join, 1);
+  mj->room = g_strdup(room);
+  mj->nick = g_strdup(nickname);
+  mj->passwd = g_strdup(passwd);
+  mj->last = hlog_get_last_timestamp(room);
+
+  if (!joins.sent && !joins.inflight && g_queue_is_empty(&joins.pending))
+    joins.start = time(NULL);
+  g_queue_insert_sorted(&joins.pending, mj, muc_join_cmp, NULL);
+  // Let the other rooms be queued before sending the joins
+  if (!joins.idle)
+    joins.idle = g_idle_add(muc_join_idle, NULL);
+}
+
+//  muc_join_done(room)
+// We have entered the room, or the server has refused our join request.
+void muc_join_done(const char *room)
+{
+  GSList *l = g_slist_find_custom(joins.inflight, room, muc_join_find);
+
+  if (!l)
+    return;
+  muc_join_free(l->data);
+  joins.inflight = g_slist_delete_link(joins.inflight, l);
+  muc_join_next();
+}
+
+//  muc_join_reset()
+// Forget the pending joins (the connection has been closed).
+void muc_join_reset(void)
+{
+  struct muc_join *mj;
+
+  while ((mj = g_queue_pop_head(&joins.pending)) != NULL)
+    muc_join_free(mj);
+  g_slist_free_full(joins.inflight, (GDestroyNotify)muc_join_free);
+  joins.inflight = NULL;
+  joins.sent = 0;
+  if (joins.idle) {
+    g_source_remove(joins.idle);
+    joins.idle = 0;
+  }
+}
+
+static void muc_seen_add(struct muc_seen *seen, guint hash, time_t timestamp,
+                         guint replay)
+{
+  seen->msg[seen->next].hash = hash;
+  seen->msg[seen->next].timestamp = timestamp;
+  seen->msg[seen->next].replay = replay;
+  seen->next = (seen->next + 1) % MUC_SEEN_SIZE;
+}
+
+//  muc_seen_hash(nick, msg)
+// Hash a room message.  The /me messages can be written to the logfile as
+// "<nick> /me action" or "*nick action", so both are hashed as the latter.
+static guint muc_seen_hash(const char *nick, const char *msg)
+{
+  gchar *text;
+  guint hash;
+
+  if (!strncmp(msg, "/me ", 4))
+    text = g_strdup_printf("*%s %s", nick, msg+4);
+  else
+    text = g_strdup_printf("<%s> %s", nick, msg);
+  hash = g_str_hash(text);
+  g_free(text);
+  return hash;
+}
+
+static void muc_seen_log(time_t timestamp, guchar info, const char *text,
+                         gpointer data)
+{
+  const char *p;
+  guint hash;
+
+  if (*text == '<' && (p = strstr(text, "> /me ")) != NULL) {
+    gchar *nick = g_strndup(text+1, p-text-1);
+    hash = muc_seen_hash(nick, p+2);
+    g_free(nick);
+  } else {
+    hash = g_str_hash(text);
+  }
+  muc_seen_add(data, hash, timestamp, 0);
+}
+
+static void muc_seen_free(gpointer data)
+{
+  struct muc_seen *seen = data;
+
+  if (seen->report)
+    g_source_remove(seen->report);
+  g_free(seen);
+}
+
+//  muc_seen_get(room)
+// Return the cache of the room.  A new cache is filled with the last
+// messages of the room history logfile.
+static struct muc_seen *muc_seen_get(const char *room)
+{
+  struct muc_seen *seen;
+  gchar *key = g_utf8_strdown(room, -1);
+
+  if (!muc_seen_rooms)
+    muc_seen_rooms = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                           g_free, muc_seen_free);
+
+  seen = g_hash_table_lookup(muc_seen_rooms, key);
+  if (seen) {
+    g_free(key);
+    return seen;
+  }
+  seen = g_new0(struct muc_seen, 1);
+  seen->room = key;
+  seen->joins = 1;
+  g_hash_table_insert(muc_seen_rooms, key, seen);
+  if (settings_opt_get_int("log_muc_conf"))
+    hlog_read_tail(room, muc_seen_log, seen);
+  return seen;
+}
+
+static gboolean muc_seen_report(gpointer data)
+{
+  struct muc_seen *seen = data;
+
+  scr_LogPrint(LPRINT_LOGNORM, "<%s>: %u history message%s already "
+               "received, skipped (%lu so far).", seen->room, seen->dropped,
+               seen->dropped > 1 ? "s" : "", muc_seen_dropped);
+  seen->dropped = 0;
+  seen->report = 0;
+  return FALSE;
+}
+
+//  muc_seen_joined(room)
+// We have (re-)entered the room, a new history replay starts.
+static void muc_seen_joined(const char *room)
+{
+  muc_seen_get(room)->joins++;
+}
+
+//  muc_message_seen(room, nick, msg, timestamp)
+// Remember a groupchat message.  Return TRUE if this is a history line
+// (timestamp is not null) we have already received or logged, in which
+// case it should be dropped.
+gboolean muc_message_seen(const char *room, const char *nick,
+                          const char *msg, time_t timestamp)
+{
+  struct muc_seen *seen;
+  guint hash, i;
+
+  if (!room || !nick || !msg)
+    return FALSE;
+
+  seen = muc_seen_get(room);
+  hash = muc_seen_hash(nick, msg);
+
+  if (!timestamp) {
+    muc_seen_add(seen, hash, time(NULL), 0);
+    return FALSE;
+  }
+
+  // The lines of the current replay are not compared with each other,
+  // the same message can be sent twice.
+  for (i = 0; i < MUC_SEEN_SIZE; i++) {
+    if (seen->msg[i].hash == hash && seen->msg[i].timestamp &&
+        seen->msg[i].replay != seen->joins &&
+        ABS(seen->msg[i].timestamp - timestamp) <= MUC_SEEN_SLACK)
+      break;
+  }
+  if (i == MUC_SEEN_SIZE) {
+    muc_seen_add(seen, hash, timestamp, seen->joins);
+    return FALSE;
+  }
+
+  seen->dropped++;
+  muc_seen_dropped++;
+  // Report when the history replay is over
+  if (seen->report)
+    g_source_remove(seen->report);
+  seen->report = g_timeout_add_seconds(MUC_SEEN_REPORT, muc_seen_report, seen);
+  return TRUE;
+}
+
 // Invite a user to a MUC room
 // room syntax: "room@server"
 // reason can be null.
@@ -186,7 +532,7 @@ void xmpp_room_invite(const char *room, const char *fjid, const char *reason)
   if (reason)
     lm_message_node_add_child(y, "reason", reason);
 
-  lm_connection_send(lconnection, msg, NULL);
+  sendq_send(msg);
   lm_message_unref(msg);
 }
 
@@ -235,7 +581,7 @@ int xmpp_room_setattrib(const char *roomid, const char *fjid,
     lm_message_node_add_child(x, "reason", reason);
 
   handler = lm_message_handler_new(handle_iq_dummy, NULL, FALSE);
-  lm_connection_send_with_reply(lconnection, iq, handler, NULL);
+  sendq_send_with_reply(iq, handler, NULL);
   lm_message_handler_unref(handler);
   lm_message_unref(iq);
 
@@ -263,7 +609,7 @@ void xmpp_room_unlock(const char *room)
                                  "type", "submit", NULL);
 
   handler = lm_message_handler_new(handle_iq_dummy, NULL, FALSE);
-  lm_connection_send_with_reply(lconnection, iq, handler, NULL);
+  sendq_send_with_reply(iq, handler, NULL);
   lm_message_handler_unref(handler);
   lm_message_unref(iq);
 }
@@ -292,7 +638,7 @@ void xmpp_room_destroy(const char *room, const char *venue, const char *reason)
     lm_message_node_add_child(x, "reason", reason);
 
   handler = lm_message_handler_new(handle_iq_dummy, NULL, FALSE);
-  lm_connection_send_with_reply(lconnection, iq, handler, NULL);
+  sendq_send_with_reply(iq, handler, NULL);
   lm_message_handler_unref(handler);
   lm_message_unref(iq);
 }
@@ -391,6 +737,8 @@ static bool muc_handle_join(const GSList *room_elt, const char *rname,
     // However, this could be a presence packet from another room member
 
     buddy_setinsideroom(room_elt->data, TRUE);
+    muc_join_done(roomjid);
+    muc_seen_joined(roomjid);
     // Set the message flag unless we're already in the room buffer window
     scr_setmsgflag_if_needed(roomjid, FALSE);
     // Add a message to the tracelog file
@@ -418,8 +766,12 @@ static bool muc_handle_join(const GSList *room_elt, const char *rname,
   } else {
     mbuf = NULL;
     if (strcmp(ournick, rname)) {
-      if (printstatus != status_none)
-        mbuf = g_strdup_printf("%s has joined", nickjid);
+      if (printstatus != status_none) {
+        if (hk_presence_batch_summary())
+          hk_presence_batch_room(roomjid, 1);
+        else
+          mbuf = g_strdup_printf("%s has joined", nickjid);
+      }
       new_member = TRUE;
     }
   }
@@ -692,9 +1044,17 @@ void handle_muc_presence(const char *from, LmMessageNode *xmldata,
 
     g_free(actor);
 
+    // Natural leaves are only counted when the presence batch is large
+    if (!our_presence && how == leave && hk_presence_batch_summary()) {
+      if (printstatus != status_none)
+        hk_presence_batch_room(roomjid, -1);
+      g_free(mbuf);
+      mbuf = NULL;
+    }
+
     // Display the mbuf message if we're concerned
     // or if the print_status isn't set to none.
-    if (our_presence || printstatus != status_none) {
+    if (mbuf && (our_presence || printstatus != status_none)) {
       msgflags = HBB_PREFIX_INFO;
       flagjoins = buddy_getflagjoins(room_elt->data);
       if (flagjoins == flagjoins_default &&
@@ -706,7 +1066,7 @@ void handle_muc_presence(const char *from, LmMessageNode *xmldata,
       scr_WriteIncomingMessage(roomjid, mbuf, usttime, msgflags, 0);
     }
 
-    if (log_muc_conf)
+    if (mbuf && log_muc_conf)
       hlog_write_message(roomjid, 0, -1, mbuf);
 
     if (our_presence) {
@@ -727,7 +1087,10 @@ void handle_muc_presence(const char *from, LmMessageNode *xmldata,
 
       if (printstatus == status_all && !nickchange) {
         const char *old_ustmsg = buddy_getstatusmsg(room_elt->data, rname);
-        if (old_ust != ust || g_strcmp0(old_ustmsg, ustmsg)) {
+        if (hk_presence_batch_summary()) {
+          if (old_ust != ust || g_strcmp0(old_ustmsg, ustmsg))
+            hk_presence_batch_room(roomjid, 0);
+        } else if (old_ust != ust || g_strcmp0(old_ustmsg, ustmsg)) {
           mbuf = g_strdup_printf("%s [%c>%c] %s", rname, imstatus2char[old_ust],
                                  imstatus2char[ust], ((ustmsg) ? ustmsg : ""));
           scr_WriteIncomingMessage(roomjid, mbuf, usttime,
@@ -750,7 +1113,7 @@ void handle_muc_presence(const char *from, LmMessageNode *xmldata,
     cmd_room_whois(room_elt->data, rname, FALSE);
   }
 
-  scr_draw_roster();
+  update_roster = TRUE;
 }
 
 void roompresence(gpointer room, void *presencedata)
@@ -16,6 +16,12 @@ void got_invite(const char* from, const char *to, const char* reason,
                 const char* passwd, gboolean reply);
 void got_muc_message(const char *from, LmMessageNode *x,
                      time_t timestamp);
+void xmpp_room_join_queued(const char *room, const char *nickname,
+                           const char *passwd);
+void muc_join_done(const char *room);
+void muc_join_reset(void);
+gboolean muc_message_seen(const char *room, const char *nick,
+                          const char *msg, time_t timestamp);
 void handle_muc_presence(const char *from, LmMessageNode * xmldata,
                          const char *roomjid, const char *rname,
                          enum imstatus ust, const char *ustmsg,
@@ -25,6 +25,7 @@
 #include "screen.h"
 #include "hbuf.h"
 #include "settings.h"
+#include "sendq.h"
 
 //  xmpp_send_s10n(jid, subtype)
 // Send a s10n message with the passed subtype
@@ -37,7 +38,7 @@ void xmpp_send_s10n(const char *bjid, LmMessageSubType type)
   LmMessage *x = lm_message_new_with_sub_type(bjid,
                                               LM_MESSAGE_TYPE_PRESENCE,
                                               type);
-  lm_connection_send(lconnection, x, NULL);
+  sendq_send(x);
   lm_message_unref(x);
 }
 